@@ -317,6 +317,7 @@ static naRef run_file(naContext ctx, struct nasal_cfg* cfg, const char* file,
     naHash_set(syms, naInternSymbol(NASTR("math")), naInit_math(ctx));
     naHash_set(syms, naInternSymbol(NASTR("bits")), naInit_bits(ctx));
     naHash_set(syms, naInternSymbol(NASTR("thread")), naInit_thread(ctx));
+    naHash_set(syms, naInternSymbol(NASTR("gc")), naInit_gc(ctx));
     naHash_set(syms, naInternSymbol(NASTR("io")), naInit_io(ctx));
     naHash_set(syms, naInternSymbol(NASTR("unix")), naInit_unix(ctx));
     naHash_set(syms, naInternSymbol(NASTR("regex")), naInit_regex(ctx));
@@ -0,0 +1,207 @@
+#include "nasal.h"
+#include "data.h"
+#include "code.h"
+
+// Size-class allocator for the out-of-line storage owned by GC'd
+// objects: string data too long to embed, VecRecs and HashRecs.
+// These are small, numerous and churn constantly as containers grow,
+// so rather than going through malloc for each one they are carved
+// out of 64k pages in a handful of fixed size classes.  Each chunk
+// is preceded by a one-naRef header recording its class, so freeing
+// needs no lookup.  Freed chunks go onto a per-class free list for
+// reuse.  Anything bigger than the largest class goes straight to
+// naAlloc().
+//
+// Records are not embedded in the objects that own them, however
+// small.  A growing vector or hash swaps in a whole new record and
+// leaves the old one to naGC_swapfree(), because other threads may
+// still be reading it without a lock; a record inside the object
+// could be neither replaced atomically nor outlive it.  Objects are
+// also fixed size, one per pool slot, so room for even a small
+// record would be paid by every object of the type.  The one case
+// that does fit is already handled: strings of up to 15 bytes live
+// in the naStr itself (see emblen in data.h).
+
+#define ARENA_PAGE_SIZE (64*1024)
+#define MAX_CLASS_SIZE 4096
+#define LARGE_CHUNK NUM_ARENA_CLASSES
+
+// Chunk sizes, including the header.  All multiples of 16.
+static const int classSizes[NUM_ARENA_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256,
+    384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+// Maps (size+15)/16 to its class index, filled in by naArena_init()
+static unsigned char sizeClass[MAX_CLASS_SIZE/16 + 1];
+
+// The header is padded to a full naRef so the payload stays aligned
+// for doubles.  Oversized chunks record their size, the others their
+// offset within the page.  A free chunk stores the free list link
+// after the header.
+typedef union { struct { int cls, size; } h; naRef align; } ChunkHdr;
+
+struct ArenaPage {
+    struct ArenaPage* next;
+    int cls;
+    int used; // chunks handed out
+};
+
+#define NEXTFREE(h) (*(ChunkHdr**)((h)+1))
+#define PAGEOF(h) ((struct ArenaPage*)((char*)(h) - (h)->h.size))
+#define PAGECHUNKS(sz) ((ARENA_PAGE_SIZE - sizeof(struct ArenaPage)) / (sz))
+
+void naArena_init()
+{
+    int i, c = 0;
+    for(i=0; i<=MAX_CLASS_SIZE/16; i++) {
+        while(classSizes[c] < i*16) c++;
+        sizeClass[i] = c;
+    }
+    for(i=0; i<=NUM_ARENA_CLASSES; i++) {
+        globals->arena[i].lock = naNewLock();
+        globals->arena[i].pages = 0;
+        globals->arena[i].free = 0;
+        globals->arena[i].used = globals->arena[i].size = 0;
+    }
+}
+
+// Must be called with the class lock held
+static void newPage(struct ArenaClass* ac, int cls)
+{
+    int i, sz = classSizes[cls], n = PAGECHUNKS(sz);
+    struct ArenaPage* pg = naAlloc(ARENA_PAGE_SIZE);
+    char* p = (char*)(pg + 1);
+    pg->cls = cls;
+    pg->used = 0;
+    pg->next = ac->pages;
+    ac->pages = pg;
+    ac->size += n * sz;
+    for(i=0; i<n; i++, p += sz) {
+        ChunkHdr* h = (ChunkHdr*)p;
+        h->h.cls = cls;
+        h->h.size = p - (char*)pg;
+        NEXTFREE(h) = ac->free;
+        ac->free = h;
+    }
+}
+
+void* naArena_alloc(int n)
+{
+    struct Globals* g = globals;
+    ChunkHdr* h;
+    struct ArenaClass* ac;
+    n += sizeof(ChunkHdr);
+    if(n > MAX_CLASS_SIZE) {
+        ac = &g->arena[LARGE_CHUNK];
+        h = naAlloc(n);
+        h->h.cls = LARGE_CHUNK;
+        h->h.size = n;
+        naLock(ac->lock);
+        ac->used += n;
+        ac->size += n;
+        naUnlock(ac->lock);
+    } else {
+        int cls = sizeClass[(n+15)>>4];
+        ac = &g->arena[cls];
+        naLock(ac->lock);
+        if(!ac->free) newPage(ac, cls);
+        h = ac->free;
+        ac->free = NEXTFREE(h);
+        ac->used += classSizes[cls];
+        PAGEOF(h)->used++;
+        naUnlock(ac->lock);
+    }
+    return h + 1;
+}
+
+void naArena_free(void* m)
+{
+    struct Globals* g = globals;
+    ChunkHdr* h = ((ChunkHdr*)m) - 1;
+    struct ArenaClass* ac;
+    if(!m) return;
+    ac = &g->arena[h->h.cls];
+    if(!g->arenaBulk) naLock(ac->lock);
+    if(h->h.cls == LARGE_CHUNK) {
+        ac->used -= h->h.size;
+        ac->size -= h->h.size;
+        naFree(h);
+    } else {
+        ac->used -= classSizes[h->h.cls];
+        PAGEOF(h)->used--;
+        NEXTFREE(h) = ac->free;
+        ac->free = h;
+    }
+    if(!g->arenaBulk) naUnlock(ac->lock);
+}
+
+// Returns the bytes taken up by an allocated chunk, header included
+int naArena_size(void* m)
+{
+    ChunkHdr* h = ((ChunkHdr*)m) - 1;
+    if(!m) return 0;
+    return h->h.cls == LARGE_CHUNK ? h->h.size : classSizes[h->h.cls];
+}
+
+// Called by the collector with all other threads stopped, around the
+// sweep and the freeing of the dead block list.  Takes every class
+// lock once up front so the (many) frees done there don't each have
+// to.
+void naArena_bulk(int begin)
+{
+    int i;
+    if(!begin) globals->arenaBulk = 0;
+    for(i=0; i<=NUM_ARENA_CLASSES; i++) {
+        if(begin) naLock(globals->arena[i].lock);
+        else      naUnlock(globals->arena[i].lock);
+    }
+    if(begin) globals->arenaBulk = 1;
+}
+
+// Totals the bytes in use and allocated over all classes
+void naArena_stats(long* used, long* size)
+{
+    int i;
+    *used = *size = 0;
+    for(i=0; i<=NUM_ARENA_CLASSES; i++) {
+        struct ArenaClass* ac = &globals->arena[i];
+        naLock(ac->lock);
+        *used += ac->used;
+        *size += ac->size;
+        naUnlock(ac->lock);
+    }
+}
+
+// Frees the pages holding no allocated chunks, for the classes where
+// at least half the page space is unused (so that a class which
+// churns through a page or two between collections doesn't keep
+// allocating and freeing them).  Called by the collector after the
+// sweep, with every class lock held.  Returns the bytes released.
+long naArena_trim()
+{
+    int i;
+    long freed = 0;
+    for(i=0; i<NUM_ARENA_CLASSES; i++) {
+        struct ArenaClass* ac = &globals->arena[i];
+        struct ArenaPage *pg, **pp;
+        ChunkHdr *h, **hp;
+        if(ac->size - ac->used <= ac->used) continue;
+
+        // Unlink the free chunks that live in empty pages...
+        for(hp = (ChunkHdr**)&ac->free; (h = *hp); ) {
+            if(PAGEOF(h)->used) hp = &NEXTFREE(h);
+            else *hp = NEXTFREE(h);
+        }
+
+        // ...then the pages themselves
+        for(pp = &ac->pages; (pg = *pp); ) {
+            if(pg->used) { pp = &pg->next; continue; }
+            *pp = pg->next;
+            ac->size -= PAGECHUNKS(classSizes[i]) * classSizes[i];
+            freed += ARENA_PAGE_SIZE;
+            naFree(pg);
+        }
+    }
+    return freed;
+}
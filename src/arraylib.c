@@ -0,0 +1,470 @@
+#include <string.h>
+#include <math.h>
+
+#include "data.h"
+
+// The bulk math functions below work on float64 arrays with SSE2 or
+// AVX when the compiler is targeting them, and plain C otherwise.
+#if defined(__AVX__)
+# include <immintrin.h>
+# define VW 4
+# define VD __m256d
+# define VLOAD _mm256_loadu_pd
+# define VSTORE _mm256_storeu_pd
+# define VSET _mm256_set1_pd
+# define VADD _mm256_add_pd
+# define VMUL _mm256_mul_pd
+# define VMIN _mm256_min_pd
+# define VMAX _mm256_max_pd
+# define VSQRT _mm256_sqrt_pd
+#elif defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+# define VW 2
+# define VD __m128d
+# define VLOAD _mm_loadu_pd
+# define VSTORE _mm_storeu_pd
+# define VSET _mm_set1_pd
+# define VADD _mm_add_pd
+# define VMUL _mm_mul_pd
+# define VMIN _mm_min_pd
+# define VMAX _mm_max_pd
+# define VSQRT _mm_sqrt_pd
+#endif
+
+// Typed arrays: numbers packed in a plain C buffer, in the machine's
+// own byte order.  They are ghosts with the indexing functions, so
+// a[i], slices, size() and foreach work on them as on vectors, and as
+// they hold no references the collector never looks inside.
+
+enum { F64, F32, I32, U8, NTYPES };
+
+static const struct { const char* name; int size; } types[NTYPES] = {
+    { "float64", 8 }, { "float32", 4 }, { "int32", 4 }, { "uint8", 1 }
+};
+
+struct Array {
+    int type;
+    int len;
+    void* data;
+};
+
+static void arrayDestroy(void* p)
+{
+    struct Array* a = p;
+    naFree(a->data);
+    naFree(a);
+}
+
+static int arraySize(void* p) { return ((struct Array*)p)->len; }
+
+static long arrayBytes(void* p)
+{
+    struct Array* a = p;
+    return sizeof(struct Array) + (long)a->len * types[a->type].size;
+}
+
+static naRef arrayGet(naContext c, void* p, int i)
+{
+    struct Array* a = p;
+    switch(a->type) {
+    case F64: return naNum(((double*)a->data)[i]);
+    case F32: return naNum(((float*)a->data)[i]);
+    case I32: return naNum(((int*)a->data)[i]);
+    default:  return naNum(((unsigned char*)a->data)[i]);
+    }
+}
+
+// Truncates d and wraps it into 32 bits, as stored in the integer
+// types.  Converting NaN, the infinities or anything out of a long
+// long's range straight to an integer is undefined, so they are
+// reduced with fmod() (which is exact) first, and NaN and the
+// infinities give zero.
+static unsigned int wrap32(double d)
+{
+    if(d != d || d - d != 0) return 0;
+    return (unsigned int)(long long)fmod(d, 4294967296.0);
+}
+
+// Stores d, truncating it for the integer types (which wrap around
+// like string elements do)
+static void put(struct Array* a, int i, double d)
+{
+    switch(a->type) {
+    case F64: ((double*)a->data)[i] = d; break;
+    case F32: ((float*)a->data)[i] = (float)d; break;
+    case I32: ((int*)a->data)[i] = (int)wrap32(d); break;
+    default:  ((unsigned char*)a->data)[i] = (unsigned char)wrap32(d);
+    }
+}
+
+// A size or index argument as an int, or -1 if it is out of range
+static int intarg(double d)
+{
+    return d >= 0 && d <= 0x7fffffff ? (int)d : -1;
+}
+
+static void arraySet(naContext c, void* p, int i, naRef val)
+{
+    naRef n = naNumValue(val);
+    if(naIsNil(n)) naRuntimeError(c, "non-numeric value stored in array");
+    put(p, i, n.num);
+}
+
+static naGhostType ArrayType = { arrayDestroy, "array", 0, 0,
+                                 arraySize, arrayGet, arraySet, arrayBytes };
+
+static naRef newarray(naContext c, int type, int len)
+{
+    struct Array* a;
+    long bytes;
+    if(len < 0 || len > 0x7fffffff / types[type].size)
+        naRuntimeError(c, "array: bad size");
+    bytes = sizeof(struct Array) + (long)len * types[type].size;
+    naGC_reserve(c, bytes);
+    naGC_spend(0, bytes);
+    a = naAlloc(sizeof(struct Array));
+    a->type = type;
+    a->len = len;
+    a->data = naAlloc(len ? len * types[type].size : 1);
+    naBZero(a->data, len * types[type].size);
+    return naNewGhost(c, &ArrayType, a);
+}
+
+static struct Array* arrayarg(naContext c, int argc, naRef* args,
+                              const char* name)
+{
+    if(argc < 1 || naGhost_type(args[0]) != &ArrayType)
+        naRuntimeError(c, "array.%s: bad/missing array", name);
+    return naGhost_ptr(args[0]);
+}
+
+static int typearg(naContext c, int argc, naRef* args, const char* name)
+{
+    int i;
+    if(argc > 0 && naIsString(args[0]))
+        for(i=0; i<NTYPES; i++)
+            if(!strcmp(naStr_data(args[0]), types[i].name))
+                return i;
+    naRuntimeError(c, "array.%s: bad/missing type", name);
+    return 0;
+}
+
+static naRef f_new(naContext c, naRef me, int argc, naRef* args)
+{
+    int type = typearg(c, argc, args, "new");
+    naRef n = argc > 1 ? naNumValue(args[1]) : naNil();
+    if(naIsNil(n)) naRuntimeError(c, "array.new: bad/missing size");
+    return newarray(c, type, intarg(n.num));
+}
+
+static naRef f_fromvec(naContext c, naRef me, int argc, naRef* args)
+{
+    int i, type = typearg(c, argc, args, "fromvec");
+    naRef r, v = argc > 1 ? args[1] : naNil();
+    struct Array* a;
+    if(!naIsVector(v)) naRuntimeError(c, "array.fromvec: bad/missing vector");
+    r = newarray(c, type, naVec_size(v));
+    a = naGhost_ptr(r);
+    for(i=0; i<a->len; i++)
+        arraySet(c, a, i, naVec_get(v, i));
+    return r;
+}
+
+static naRef f_tovec(naContext c, naRef me, int argc, naRef* args)
+{
+    int i;
+    struct Array* a = arrayarg(c, argc, args, "tovec");
+    naRef v = naNewVector(c);
+    naVec_setsize(v, a->len);
+    for(i=0; i<a->len; i++)
+        naVec_set(v, i, arrayGet(c, a, i));
+    return v;
+}
+
+static naRef f_frombuf(naContext c, naRef me, int argc, naRef* args)
+{
+    int type = typearg(c, argc, args, "frombuf"), len;
+    naRef r, s = argc > 1 ? args[1] : naNil();
+    if(!naIsString(s)) naRuntimeError(c, "array.frombuf: bad/missing string");
+    len = naStr_len(s);
+    if(len % types[type].size)
+        naRuntimeError(c, "array.frombuf: length not a multiple of %d",
+                       types[type].size);
+    r = newarray(c, type, len / types[type].size);
+    memcpy(((struct Array*)naGhost_ptr(r))->data, naStr_data(s), len);
+    return r;
+}
+
+static naRef f_tobuf(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Array* a = arrayarg(c, argc, args, "tobuf");
+    return naStr_fromdata(naNewString(c), a->data,
+                          a->len * types[a->type].size);
+}
+
+static naRef f_slice(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Array* a = arrayarg(c, argc, args, "slice");
+    naRef r, start = argc > 1 ? naNumValue(args[1]) : naNil();
+    naRef len = argc > 2 ? naNumValue(args[2]) : naNil();
+    int s, n, sz = types[a->type].size;
+    if(naIsNil(start)) naRuntimeError(c, "array.slice: bad/missing start");
+    s = intarg(start.num);
+    n = naIsNil(len) ? a->len - s : intarg(len.num);
+    if(s < 0 || n < 0 || s > a->len || n > a->len - s)
+        naRuntimeError(c, "array.slice: range out of bounds");
+    r = newarray(c, a->type, n);
+    memcpy(((struct Array*)naGhost_ptr(r))->data, (char*)a->data + s*sz, n*sz);
+    return r;
+}
+
+static naRef f_fill(naContext c, naRef me, int argc, naRef* args)
+{
+    int i;
+    struct Array* a = arrayarg(c, argc, args, "fill");
+    naRef n = argc > 1 ? naNumValue(args[1]) : naNil();
+    if(naIsNil(n)) naRuntimeError(c, "array.fill: bad/missing value");
+    for(i=0; i<a->len; i++)
+        put(a, i, n.num);
+    return args[0];
+}
+
+static naRef f_type(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Array* a = arrayarg(c, argc, args, "type");
+    const char* s = types[a->type].name;
+    return naStr_fromdata(naNewString(c), s, strlen(s));
+}
+
+////////////////////////////////////////////////////////////////////////
+// Bulk math over float64 arrays.  The elementwise functions write
+// into an array the caller made (which may also be an input), so a
+// loop over a signal allocates nothing.
+
+static struct Array* f64arg(naContext c, int argc, naRef* args, int i,
+                            const char* name)
+{
+    struct Array* a = 0;
+    if(i < argc && naGhost_type(args[i]) == &ArrayType)
+        a = naGhost_ptr(args[i]);
+    if(!a || a->type != F64)
+        naRuntimeError(c, "array.%s: bad/missing float64 array", name);
+    return a;
+}
+
+// Checks the arguments of an elementwise function, the output then
+// nin inputs, all the same size.  Stores their data in p, and returns
+// the size.
+static int ewargs(naContext c, int argc, naRef* args, int nin,
+                  const char* name, double** p)
+{
+    int i, n = 0;
+    struct Array* a;
+    for(i=0; i<=nin; i++) {
+        a = f64arg(c, argc, args, i, name);
+        if(i && a->len != n)
+            naRuntimeError(c, "array.%s: sizes differ", name);
+        n = a->len;
+        p[i] = a->data;
+    }
+    return n;
+}
+
+static naRef f_add(naContext c, naRef me, int argc, naRef* args)
+{
+    int i = 0, n;
+    double* p[3];
+    n = ewargs(c, argc, args, 2, "add", p);
+#ifdef VW
+    for(; i+VW <= n; i += VW)
+        VSTORE(p[0]+i, VADD(VLOAD(p[1]+i), VLOAD(p[2]+i)));
+#endif
+    for(; i<n; i++) p[0][i] = p[1][i] + p[2][i];
+    return args[0];
+}
+
+static naRef f_mul(naContext c, naRef me, int argc, naRef* args)
+{
+    int i = 0, n;
+    double* p[3];
+    n = ewargs(c, argc, args, 2, "mul", p);
+#ifdef VW
+    for(; i+VW <= n; i += VW)
+        VSTORE(p[0]+i, VMUL(VLOAD(p[1]+i), VLOAD(p[2]+i)));
+#endif
+    for(; i<n; i++) p[0][i] = p[1][i] * p[2][i];
+    return args[0];
+}
+
+static naRef f_scale(naContext c, naRef me, int argc, naRef* args)
+{
+    int i = 0, n;
+    double k, *p[2];
+    naRef kr = argc > 2 ? naNumValue(args[2]) : naNil();
+    n = ewargs(c, argc, args, 1, "scale", p);
+    if(naIsNil(kr)) naRuntimeError(c, "array.scale: bad/missing factor");
+    k = kr.num;
+#ifdef VW
+    {
+        VD kv = VSET(k);
+        for(; i+VW <= n; i += VW)
+            VSTORE(p[0]+i, VMUL(VLOAD(p[1]+i), kv));
+    }
+#endif
+    for(; i<n; i++) p[0][i] = p[1][i] * k;
+    return args[0];
+}
+
+static naRef f_fma(naContext c, naRef me, int argc, naRef* args)
+{
+    int i = 0, n;
+    double* p[4];
+    n = ewargs(c, argc, args, 3, "fma", p);
+#ifdef VW
+    for(; i+VW <= n; i += VW)
+        VSTORE(p[0]+i, VADD(VMUL(VLOAD(p[1]+i), VLOAD(p[2]+i)),
+                            VLOAD(p[3]+i)));
+#endif
+    for(; i<n; i++) p[0][i] = p[1][i] * p[2][i] + p[3][i];
+    return args[0];
+}
+
+static naRef f_sqrt(naContext c, naRef me, int argc, naRef* args)
+{
+    int i = 0, n;
+    double* p[2];
+    n = ewargs(c, argc, args, 1, "sqrt", p);
+#ifdef VW
+    for(; i+VW <= n; i += VW)
+        VSTORE(p[0]+i, VSQRT(VLOAD(p[1]+i)));
+#endif
+    for(; i<n; i++) p[0][i] = sqrt(p[1][i]);
+    return args[0];
+}
+
+// There are no vector instructions for these, but a C loop is still
+// far quicker than one in Nasal
+#define LIBMFN(name, fn) \
+    static naRef name(naContext c, naRef me, int argc, naRef* args) \
+    {                                                               \
+        int i, n;                                                   \
+        double* p[2];                                               \
+        n = ewargs(c, argc, args, 1, #fn, p);                       \
+        for(i=0; i<n; i++) p[0][i] = fn(p[1][i]);                   \
+        return args[0];                                             \
+    }
+LIBMFN(f_sin, sin)
+LIBMFN(f_cos, cos)
+LIBMFN(f_exp, exp)
+#undef LIBMFN
+
+// The sum of a, or of a[i]*b[i] if b is given.  It is added up in VW
+// separate lanes, so it can differ in the last bits from a sum taken
+// in order.
+static double sum(double* a, double* b, int n)
+{
+    int i = 0;
+    double r = 0;
+#ifdef VW
+    double lanes[VW];
+    int j;
+    VD acc = VSET(0);
+    if(b) for(; i+VW <= n; i += VW)
+        acc = VADD(acc, VMUL(VLOAD(a+i), VLOAD(b+i)));
+    else for(; i+VW <= n; i += VW)
+        acc = VADD(acc, VLOAD(a+i));
+    VSTORE(lanes, acc);
+    for(j=0; j<VW; j++) r += lanes[j];
+#endif
+    for(; i<n; i++) r += b ? a[i] * b[i] : a[i];
+    return r;
+}
+
+static naRef f_dot(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Array* a = f64arg(c, argc, args, 0, "dot");
+    struct Array* b = f64arg(c, argc, args, 1, "dot");
+    if(a->len != b->len) naRuntimeError(c, "array.dot: sizes differ");
+    return naNum(sum(a->data, b->data, a->len));
+}
+
+static naRef f_sum(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Array* a = f64arg(c, argc, args, 0, "sum");
+    return naNum(sum(a->data, 0, a->len));
+}
+
+static naRef f_mean(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Array* a = f64arg(c, argc, args, 0, "mean");
+    return a->len ? naNum(sum(a->data, 0, a->len) / a->len) : naNil();
+}
+
+// The smallest element, or the largest if max is set
+// NaN elements are skipped, by both paths alike: the vector min/max
+// instructions return their second operand when either is NaN, so the
+// running result goes second, and the scalar comparisons are false.
+static naRef minmax(naContext c, int argc, naRef* args, int max)
+{
+    int i = 0;
+    struct Array* a = f64arg(c, argc, args, 0, max ? "max" : "min");
+    double *d = a->data, none = max ? -HUGE_VAL : HUGE_VAL, r = none;
+#ifdef VW
+    if(a->len >= VW) {
+        double lanes[VW];
+        int j;
+        VD acc = VSET(none);
+        for(; i+VW <= a->len; i += VW)
+            acc = max ? VMAX(VLOAD(d+i), acc) : VMIN(VLOAD(d+i), acc);
+        VSTORE(lanes, acc);
+        for(j=0; j<VW; j++)
+            if(max ? lanes[j] > r : lanes[j] < r) r = lanes[j];
+    }
+#endif
+    for(; i<a->len; i++)
+        if(max ? d[i] > r : d[i] < r) r = d[i];
+    if(r == none) // an infinity, or nothing but NaNs?
+        for(i=0; i<a->len; i++)
+            if(d[i] == none) return naNum(r);
+    return r == none ? naNil() : naNum(r);
+}
+
+static naRef f_min(naContext c, naRef me, int argc, naRef* args)
+{
+    return minmax(c, argc, args, 0);
+}
+
+static naRef f_max(naContext c, naRef me, int argc, naRef* args)
+{
+    return minmax(c, argc, args, 1);
+}
+
+static naCFuncItem funcs[] = {
+    { "new", f_new },
+    { "fromvec", f_fromvec },
+    { "tovec", f_tovec },
+    { "frombuf", f_frombuf },
+    { "tobuf", f_tobuf },
+    { "slice", f_slice },
+    { "fill", f_fill },
+    { "type", f_type },
+    { "add", f_add },
+    { "mul", f_mul },
+    { "scale", f_scale },
+    { "fma", f_fma },
+    { "sqrt", f_sqrt },
+    { "sin", f_sin },
+    { "cos", f_cos },
+    { "exp", f_exp },
+    { "dot", f_dot },
+    { "sum", f_sum },
+    { "mean", f_mean },
+    { "min", f_min },
+    { "max", f_max },
+    { 0 }
+};
+
+naRef naInit_array(naContext c)
+{
+    return naGenLib(c, funcs);
+}
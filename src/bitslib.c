@@ -70,6 +70,7 @@ static naRef f_buf(naContext c, naRef me, int argc, naRef* args)
 {
     naRef len = argc ? naNumValue(args[0]) : naNil();
     if(IS_NIL(len)) naRuntimeError(c, "missing/bad argument to buf");
+    naGC_reserve(c, (long)len.num + 1);
     return naStr_buf(naNewString(c), (int)len.num);
 }
 
@@ -24,7 +24,9 @@ void printStackDEBUG(naContext ctx);
 #define vsnprintf _vsnprintf
 #endif
 
-struct Globals* globals = 0;
+NA_THREAD_LOCAL struct Globals* nasal_globals = 0;
+static struct Globals* volatile mainIsolate = 0; // the default isolate
+static volatile int mainOnce = 0;
 
 static naRef bindFunction(naContext ctx, struct Frame* f, naRef code);
 
@@ -87,13 +89,29 @@ static naRef stringify(naContext ctx, naRef r)
     return naNil();
 }
 
+// Ghosts with a get function can be indexed like vectors
+#define IS_INDEXABLE(r) (IS_GHOST(r) && PTR(r).ghost->gtype->get)
+#define GHOSTOP(r, op) (PTR(r).ghost->gtype->op)
+
+static int seqSize(naRef v)
+{
+    if(IS_VEC(v)) return naVec_size(v);
+    return GHOSTOP(v, size)(PTR(v).ghost->ptr);
+}
+
+static naRef seqGet(naContext ctx, naRef v, int i)
+{
+    if(IS_VEC(v)) return naVec_get(v, i);
+    return GHOSTOP(v, get)(ctx, PTR(v).ghost->ptr, i);
+}
+
 static int checkVec(naContext ctx, naRef vec, naRef idx)
 {
-    int i = (int)numify(ctx, idx);
-    if(i < 0) i += naVec_size(vec);
-    if(i < 0 || i >= naVec_size(vec))
+    int i = (int)numify(ctx, idx), sz = seqSize(vec);
+    if(i < 0) i += sz;
+    if(i < 0 || i >= sz)
         naRuntimeError(ctx, "vector index %d out of bounds (size: %d)",
-                       i, naVec_size(vec));
+                       i, sz);
     return i;
 }
 
@@ -117,6 +135,8 @@ static naRef containerGet(naContext ctx, naRef box, naRef key)
         result = naVec_get(box, checkVec(ctx, box, key));
     else if(IS_STR(box))
         result = naNum((unsigned char)naStr_data(box)[checkStr(ctx, box, key)]);
+    else if(IS_INDEXABLE(box))
+        result = seqGet(ctx, box, checkVec(ctx, box, key));
     else
         ERR(ctx, "extract from non-container");
     return result;
@@ -131,6 +151,8 @@ static void containerSet(naContext ctx, naRef box, naRef key, naRef val)
         if(PTR(box).str->hashcode)
             ERR(ctx, "cannot change immutable string");
         naStr_data(box)[checkStr(ctx, box, key)] = (char)numify(ctx, val);
+    } else if(IS_INDEXABLE(box) && GHOSTOP(box, set)) {
+        GHOSTOP(box, set)(ctx, PTR(box).ghost->ptr, checkVec(ctx, box, key), val);
     } else ERR(ctx, "insert into non-container");
 }
 
@@ -145,8 +167,11 @@ static void initContext(naContext c)
 {
     int i;
     c->fTop = c->opTop = c->markTop = 0;
-    for(i=0; i<NUM_NASAL_TYPES; i++)
+    c->detached = c->unsafe = 0;
+    for(i=0; i<NUM_NASAL_TYPES; i++) {
         c->nfree[i] = 0;
+        c->cachesz[i] = 1;
+    }
 
     if(c->tempsz > 32) {
         naFree(c->temps);
@@ -155,7 +180,10 @@ static void initContext(naContext c)
 
     c->callParent = 0;
     c->callChild = 0;
+    c->isolate = globals;
     c->dieArg = naNil();
+    c->maxObjects = c->maxBytes = c->usedObjects = c->usedBytes = 0;
+    c->overBudget = c->grace = 0;
     c->error[0] = 0;
     c->userData = 0;
 }
@@ -164,25 +192,30 @@ static void initGlobals()
 {
     int i;
     naContext c;
-    globals = (struct Globals*)naAlloc(sizeof(struct Globals));
-    naBZero(globals, sizeof(struct Globals));
+    nasal_globals = (struct Globals*)naAlloc(sizeof(struct Globals));
+    naBZero(nasal_globals, sizeof(struct Globals));
 
     globals->sem = naNewSem();
     globals->lock = naNewLock();
+    globals->shapeLock = naNewLock();
 
     globals->allocCount = 256; // reasonable starting value
+    globals->tuning.minFree = 0.25;
+    globals->tuning.growFree = 0.5;
+    globals->tuning.allocRatio = 0.5;
     for(i=0; i<NUM_NASAL_TYPES; i++)
         naGC_init(&(globals->pools[i]), i);
     globals->deadsz = 256;
     globals->ndead = 0;
     globals->deadBlocks = naAlloc(sizeof(void*) * globals->deadsz);
+    naArena_init();
 
     // Initialize a single context
     globals->freeContexts = 0;
     globals->allContexts = 0;
     c = naNewContext();
 
-    globals->symbols = naNewHash(c);
+    globals->symbols = naNewWeakHash(c);
     globals->save = naNewVector(c);
 
     // Cache pre-calculated "me", "arg" and "parents" scalars
@@ -193,12 +226,46 @@ static void initGlobals()
     naFreeContext(c);
 }
 
+naIsolate naNewIsolate()
+{
+    struct Globals* saved = nasal_globals;
+    naIsolate iso;
+    initGlobals();
+    iso = nasal_globals;
+    nasal_globals = saved;
+    return iso;
+}
+
+// Makes the default isolate the calling thread's, creating it on first
+// use.  Only one of the threads that might get here at once creates
+// it; the others wait for it.
+struct Globals* naDefaultIsolate()
+{
+    if(!mainIsolate) {
+        if(naAtomicCAS(&mainOnce, 0, 1)) {
+            naIsolate iso = naNewIsolate();
+            naMemBarrier();
+            mainIsolate = iso;
+        } else {
+            while(!mainIsolate) naMemBarrier();
+        }
+    }
+    return nasal_globals = mainIsolate;
+}
+
+naIsolate naGetIsolate()
+{
+    return globals;
+}
+
+void naSetIsolate(naIsolate iso)
+{
+    nasal_globals = iso ? iso : naDefaultIsolate();
+}
+
 naContext naNewContext()
 {
     naContext c;
-    if(globals == 0)
-        initGlobals();
-
     LOCK();
     c = globals->freeContexts;
     if(c) {
@@ -231,13 +298,17 @@ naContext naSubContext(naContext super)
 
 void naFreeContext(naContext c)
 {
+    struct Globals* prev = nasal_globals;
+    nasal_globals = c->isolate;
     c->ntemps = 0;
     if(c->callChild) naFreeContext(c->callChild);
     if(c->callParent) c->callParent->callChild = 0;
     LOCK();
+    naGC_release(c);
     c->nextFree = globals->freeContexts;
     globals->freeContexts = c;
     UNLOCK();
+    nasal_globals = prev;
 }
 
 // Note that opTop is incremented separately, to avoid situations
@@ -332,7 +403,7 @@ static struct Frame* setupFuncall(naContext ctx, int nargs, int mcall, int named
     f->ip = 0;
     f->bp = ctx->opFrame;
 
-    if(mcall) naHash_set(f->locals, globals->meRef, obj);
+    if(mcall) naHash_set(f->locals, ctx->isolate->meRef, obj);
 
     if(named) checkNamedArgs(ctx, PTR(code).code, PTR(f->locals).hash);
     else      setupArgs(ctx, f, args, nargs);
@@ -471,13 +542,20 @@ static void evalEach(naContext ctx, int useIndex)
 {
     int idx = (int)(ctx->opStack[ctx->opTop-1].num);
     naRef vec = ctx->opStack[ctx->opTop-2];
-    if(!IS_VEC(vec)) ERR(ctx, "foreach enumeration of non-vector");
-    if(!PTR(vec).vec->rec || idx >= PTR(vec).vec->rec->size) {
+    if(IS_GHOST(vec) && !useIndex && PTR(vec).ghost->gtype->next) {
+        int done = 0;
+        naRef r = PTR(vec).ghost->gtype->next(ctx, PTR(vec).ghost->ptr, &done);
+        PUSH(done ? endToken() : r);
+        return;
+    }
+    if(!IS_VEC(vec) && !IS_INDEXABLE(vec))
+        ERR(ctx, "foreach enumeration of non-vector");
+    if(idx >= seqSize(vec)) {
         PUSH(endToken());
         return;
     }
     ctx->opStack[ctx->opTop-1].num = idx+1; // modify in place
-    PUSH(useIndex ? naNum(idx) : naVec_get(vec, idx));
+    PUSH(useIndex ? naNum(idx) : seqGet(ctx, vec, idx));
 }
 
 static void evalUnpack(naContext ctx, int count)
@@ -491,7 +569,7 @@ static void evalUnpack(naContext ctx, int count)
 // FIXME: unify with almost identical checkVec() above
 static int vbound(naContext ctx, naRef v, naRef ir, int end)
 {
-    int sz=naVec_size(v), i = IS_NIL(ir) ? (end ? -1 : 0) : numify(ctx, ir);
+    int sz=seqSize(v), i = IS_NIL(ir) ? (end ? -1 : 0) : numify(ctx, ir);
     if(IS_NIL(ir) && !sz) return i;
     if(i < 0) i += sz;
     if(i < 0 || i >= sz)
@@ -502,18 +580,18 @@ static int vbound(naContext ctx, naRef v, naRef ir, int end)
 
 static void evalSlice(naContext ctx, naRef src, naRef dst, naRef idx)
 {
-    if(!IS_VEC(src)) ERR(ctx, "cannot slice non-vector");
-    naVec_append(dst, naVec_get(src, checkVec(ctx, src, idx)));
+    if(!IS_VEC(src) && !IS_INDEXABLE(src)) ERR(ctx, "cannot slice non-vector");
+    naVec_append(dst, seqGet(ctx, src, checkVec(ctx, src, idx)));
 }
  
 static void evalSlice2(naContext ctx, naRef src, naRef dst,
                        naRef start, naRef endr)
 {
     int i, end;
-    if(!IS_VEC(src)) ERR(ctx, "cannot slice non-vector");
+    if(!IS_VEC(src) && !IS_INDEXABLE(src)) ERR(ctx, "cannot slice non-vector");
     end = vbound(ctx, src, endr, 1);
     for(i = vbound(ctx, src, start, 0); i<=end; i++)
-        naVec_append(dst, naVec_get(src, i));
+        naVec_append(dst, seqGet(ctx, src, i));
 }
 
 #define ARG() BYTECODE(cd)[f->ip++]
@@ -522,6 +600,7 @@ static void evalSlice2(naContext ctx, naRef src, naRef dst,
 #define STK(n) (ctx->opStack[ctx->opTop-(n)])
 #define SETFRAME(F) f = (F); cd = PTR(PTR(f->func).func->code).code;
 #define FIXFRAME() SETFRAME(&(ctx->fStack[ctx->fTop-1]))
+#define POLL() do { if(NEED_SAFEPOINT(ctx->isolate)) naGC_safepoint(ctx); } while(0)
 static naRef run(naContext ctx)
 {
     struct Frame* f;
@@ -600,7 +679,7 @@ static naRef run(naContext ctx)
             ctx->opTop--;
             break;
         case OP_NEWHASH:
-            PUSH(naNewHash(ctx));
+            PUSH(naNewShapedHash(ctx));
             break;
         case OP_HAPPEND:
             naHash_set(STK(3), STK(2), STK(1));
@@ -645,7 +724,7 @@ static naRef run(naContext ctx)
             break;
         case OP_JMPLOOP:
             // Identical to JMP, except for locking
-            naCheckBottleneck();
+            POLL();
             f->ip = BYTECODE(cd)[f->ip];
             DBG(printf("   [Jump to: %d]\n", f->ip));
             break;
@@ -682,10 +761,12 @@ static naRef run(naContext ctx)
                 DBG(printf("   [Jump to: %d]\n", f->ip));
             }
             break;
-        case OP_FCALL:  SETFRAME(setupFuncall(ctx, ARG(), 0, 0)); break;
-        case OP_MCALL:  SETFRAME(setupFuncall(ctx, ARG(), 1, 0)); break;
-        case OP_FCALLH: SETFRAME(setupFuncall(ctx,     1, 0, 1)); break;
-        case OP_MCALLH: SETFRAME(setupFuncall(ctx,     1, 1, 1)); break;
+        // Calls and returns poll for a safe point too, so a stop isn't
+        // held up by long stretches of code without loops
+        case OP_FCALL:  SETFRAME(setupFuncall(ctx, ARG(), 0, 0)); POLL(); break;
+        case OP_MCALL:  SETFRAME(setupFuncall(ctx, ARG(), 1, 0)); POLL(); break;
+        case OP_FCALLH: SETFRAME(setupFuncall(ctx,     1, 0, 1)); POLL(); break;
+        case OP_MCALLH: SETFRAME(setupFuncall(ctx,     1, 1, 1)); POLL(); break;
         case OP_RETURN:
             a = STK(1);
             ctx->dieArg = naNil();
@@ -694,6 +775,7 @@ static naRef run(naContext ctx)
             ctx->opTop = f->bp + 1; // restore the correct opstack frame!
             STK(1) = a;
             FIXFRAME();
+            POLL();
             break;
         case OP_EACH:
             evalEach(ctx, 0);
@@ -730,6 +812,7 @@ static naRef run(naContext ctx)
 #undef CONSTARG
 #undef STK
 #undef FIXFRAME
+#undef POLL
 
 void naSave(naContext ctx, naRef obj)
 {
@@ -799,12 +882,37 @@ naRef naBindToContext(naContext ctx, naRef code)
     return func;
 }
 
+// Makes ctx's isolate the thread's for a call, remembering the one
+// the caller was in: a C function may call into a context of another
+// isolate, and must find itself back in its own afterwards.
+static void callstart(naContext ctx)
+{
+    ctx->prevIsolate = nasal_globals;
+    nasal_globals = ctx->isolate;
+    if(!ctx->callParent) naModLock();
+    ctx->prevRun = naGC_run(ctx);
+}
+
+// Finishes a call.  At the top level the mod lock is dropped, so the
+// result is kept in the context's temps (which also pins it) until
+// the context next runs, for the caller to pick up safely.
+static naRef callend(naContext ctx, naRef result)
+{
+    naGC_run(ctx->prevRun);
+    if(!ctx->callParent) {
+        naTempSave(ctx, result);
+        naModUnlock();
+    }
+    nasal_globals = ctx->prevIsolate;
+    return result;
+}
+
 naRef naCall(naContext ctx, naRef func, int argc, naRef* args,
              naRef obj, naRef locals)
 {
     int i;
     naRef result;
-    if(!ctx->callParent) naModLock();
+    callstart(ctx);
 
     // We might have to allocate objects, which can call the GC.  But
     // the call isn't on the Nasal stack yet, so the GC won't find our
@@ -817,15 +925,16 @@ naRef naCall(naContext ctx, naRef func, int argc, naRef* args,
 
     // naRuntimeError() calls end up here:
     if(setjmp(ctx->jumpHandle)) {
+        naGC_run(ctx->prevRun);
         if(!ctx->callParent) naModUnlock();
+        nasal_globals = ctx->prevIsolate;
         return naNil();
     }
 
     if(IS_CCODE(PTR(func).func->code)) {
         naCFunction fp = PTR(PTR(func).func->code).ccode->fptr;
         result = (*fp)(ctx, obj, argc, args);
-        if(!ctx->callParent) naModUnlock();
-        return result;
+        return callend(ctx, result);
     }
 
     if(IS_NIL(locals))
@@ -835,7 +944,7 @@ naRef naCall(naContext ctx, naRef func, int argc, naRef* args,
         PTR(func).func->namespace = locals;
     }
     if(!IS_NIL(obj))
-        naHash_set(locals, globals->meRef, obj);
+        naHash_set(locals, ctx->isolate->meRef, obj);
 
     ctx->opTop = ctx->markTop = 0;
     ctx->fTop = 1;
@@ -848,31 +957,37 @@ naRef naCall(naContext ctx, naRef func, int argc, naRef* args,
     setupArgs(ctx, ctx->fStack, args, argc);
 
     result = run(ctx);
-    if(!ctx->callParent) naModUnlock();
-    return result;
+    return callend(ctx, result);
 }
 
 naRef naContinue(naContext ctx)
+{
+    return naContinueWith(ctx, naNil());
+}
+
+naRef naContinueWith(naContext ctx, naRef value)
 {
     naRef result;
-    if(!ctx->callParent) naModLock();
+    callstart(ctx);
 
     ctx->dieArg = naNil();
     ctx->error[0] = 0;
 
     if(setjmp(ctx->jumpHandle)) {
+        naGC_run(ctx->prevRun);
         if(!ctx->callParent) naModUnlock();
-        else naRethrowError(ctx);
+        nasal_globals = ctx->prevIsolate;
+        if(ctx->callParent) naRethrowError(ctx);
         return naNil();
     }
 
     // Wipe off the old function arguments, and push the expected
-    // result (either the result of our subcontext, or a synthesized
-    // nil if the thrown error was from an extension function or
+    // result (either the result of our subcontext, or the supplied
+    // value if the thrown error was from an extension function or
     // in-script die() call) before re-running the code from the
     // instruction following the error.
     ctx->opTop = ctx->opFrame;
-    PUSH(ctx->callChild ? naContinue(ctx->callChild) : naNil());
+    PUSH(ctx->callChild ? naContinueWith(ctx->callChild, value) : value);
 
     // Getting here means the child completed successfully.  But
     // because its original C stack was longjmp'd out of existence,
@@ -881,6 +996,5 @@ naRef naContinue(naContext ctx)
     if(ctx->callChild) naFreeContext(ctx->callChild);
 
     result = run(ctx);
-    if(!ctx->callParent) naModUnlock();
-    return result;
+    return callend(ctx, result);
 }
@@ -9,14 +9,14 @@
 #define MAX_RECURSION 128
 #define MAX_MARK_DEPTH 128
 
-// Number of objects (per pool per thread) asked for using naGC_get().
-// The idea is that contexts can "cache" allocations to prevent thread
-// contention on the global pools.  But in practice this interacts
-// very badly with small subcontext calls, which grab huge numbers of
-// cached objects and don't use them, causing far more collections
-// than necessary.  Just leave it at 1 pending a rework of the
-// collector synchronization.
-#define OBJ_CACHE_SZ 1
+// Maximum number of objects (per pool per context) asked for at once
+// using naGC_get().  Contexts "cache" a run of the global free list
+// and allocate out of it without touching the global lock.  Small
+// subcontext calls would grab huge numbers of cached objects and
+// never use them, so the request size starts at one and doubles with
+// each refill up to this limit.  Anything still cached when the
+// context is freed is handed back to the pool by naGC_release().
+#define OBJ_CACHE_SZ 64
 
 enum {    
     OP_NOT, OP_MUL, OP_PLUS, OP_MINUS, OP_DIV, OP_NEG, OP_CAT, OP_LT, OP_LTE,
@@ -29,6 +29,17 @@ enum {
     OP_MCALLH, OP_XCHG2, OP_UNPACK, OP_SLICE, OP_SLICE2
 };
 
+// Size classes for out-of-line object storage, see arena.c
+#define NUM_ARENA_CLASSES 16
+
+struct ArenaClass {
+    void* lock;
+    struct ArenaPage* pages;
+    void* free;
+    long used; // bytes handed out
+    long size; // bytes in pages
+};
+
 struct Frame {
     naRef func; // naFunc object
     naRef locals; // local per-call namespace
@@ -45,15 +56,36 @@ struct Globals {
     void** deadBlocks;
     int deadsz;
     int ndead;
+
+    // Per-size-class pages for string, vector and hash storage.  The
+    // extra entry at the end tracks oversized chunks.
+    struct ArenaClass arena[NUM_ARENA_CLASSES+1];
+    int arenaBulk; // set while the collector holds every class lock
     
     // Threading stuff
     int nThreads;
     int waitCount;
     int needGC;
+    int needCompact; // compact at the next safe point
+    int lastCompact; // collection count at the last compaction
     int bottleneck;
+    double stopStart; // when the current bottleneck was engaged
+    int safeCount;   // bottleneck waiters at a safe point
+    int nNative;     // threads in the native state, see naEnterNative()
+    volatile unsigned int epoch; // for freeing replaced storage, see gc.c
+    int needEpoch;   // a thread is waiting for the epoch to advance
+    int budgetHit;   // some context is over its memory budget
+    struct EpochRec* epochRecs;
+    void* epochKey;  // thread local slot for the thread's EpochRec
+    void* snapshot;  // FILE to write a heap snapshot to, see naGCSnapshot()
+    void* threadPool; // the default for thread.pmap() etc., see threadlib.c
     void* sem;
     void* lock;
 
+    // Collector statistics and tunables, see naGCStats()
+    naGCInfo stats;
+    naGCTuning tuning;
+
     // Constants
     naRef meRef;
     naRef argRef;
@@ -62,8 +94,32 @@ struct Globals {
     // A hash of symbol names
     naRef symbols;
 
+    // The shapes of object hashes, see hash.c
+    struct Shape* shapes;
+    struct Shape* rootShape;
+    int nShapes;
+    void* shapeLock;
+
     naRef save;
 
+    // Destructors of collected ghosts, waiting for naGCFinalize()
+    struct GhostFinal { void (*destroy)(void*); void* ptr; }* finalq;
+    int nfinal;
+    int finalsz;
+
+    // Symbols recently returned by naInternSymbol(), see naGC_holdsym()
+    naRef* heldSyms;
+    int nHeldSyms;
+    int heldSymsSz;
+    int heldSymsOld; // how many of them predate the last collection
+
+    // naRefs held by C code, see naGCSave().  Free slots hold the
+    // number of the next free one, plus one.
+    naRef* cRoots;
+    int nCRoots;
+    int cRootsSz;
+    int cRootsFree; // first free slot plus one, or zero
+
     struct Context* freeContexts;
     struct Context* allContexts;
 };
@@ -77,10 +133,13 @@ struct Context {
     int opTop;
     int markStack[MAX_MARK_DEPTH];
     int markTop;
+    int detached; // not a GC root, reached through its owner instead
+    int unsafe;   // run by C code holding naRefs: never compact under it
 
     // Free object lists, cached from the global GC
     struct naObj** free[NUM_NASAL_TYPES];
     int nfree[NUM_NASAL_TYPES];
+    int cachesz[NUM_NASAL_TYPES]; // size of the next naGC_get() request
 
     // GC-findable reference point for objects that may live on the
     // processor ("real") stack during execution.  naNew() places them
@@ -94,6 +153,19 @@ struct Context {
     char error[128];
     naRef dieArg;
 
+    // Memory budget for the context and its subcontexts (zero for no
+    // limit), and what they kept reachable at the last collection.
+    // See naSetBudget().
+    long maxObjects;
+    long maxBytes;
+    long usedObjects;
+    long usedBytes;
+    int overBudget;
+    int grace; // allowed a little more after a budget error
+    long graceObjects, graceBytes; // the limits while it is
+    struct Context* prevRun; // running on this thread before, see naGC_run()
+    struct Globals* prevIsolate; // the thread's isolate before the call
+
     // Sub-call lists
     struct Context* callParent;
     struct Context* callChild;
@@ -102,11 +174,26 @@ struct Context {
     struct Context* nextFree;
     struct Context* nextAll;
 
+    struct Globals* isolate; // the globals it belongs to
+
     void* userData;
 };
 
-#define globals nasal_globals
-extern struct Globals* globals;
+#ifdef _MSC_VER
+#define NA_THREAD_LOCAL __declspec(thread)
+#else
+#define NA_THREAD_LOCAL __thread
+#endif
+
+// The isolate the calling thread is working in, see naSetIsolate().
+// A thread that never picked one, like an embedder's thread taking
+// the mod lock before any naCall(), gets the default isolate.  Each
+// use is a thread local read and a branch (and in a shared library a
+// call), so hot paths use ctx->isolate when they have a context, or
+// read it once into a local.
+extern NA_THREAD_LOCAL struct Globals* nasal_globals;
+struct Globals* naDefaultIsolate();
+#define globals (nasal_globals ? nasal_globals : naDefaultIsolate())
 
 // Threading low-level functions
 void* naNewLock();
@@ -117,8 +204,39 @@ void* naNewSem();
 void naFreeSem(void* sem);
 void naSemDown(void* sem);
 void naSemUp(void* sem, int count);
+int naSemDownTimed(void* sem, double secs); // zero if it timed out
+void* naNewRWLock();
+void naFreeRWLock(void* lock);
+void naRWLock(void* lock, int write);
+void naRWUnlock(void* lock, int write); // write must match the naRWLock()
+void* naNewCond();
+void naFreeCond(void* cond);
+int naCondWait(void* cond, void* lock, double secs); // secs<0: no timeout; zero if timed out
+void naCondSignal(void* cond, int all);
+double naTime(); // monotonic seconds, for statistics
+void* naNewTls(void (*destroy)(void*)); // destroy is called at thread exit
+void* naTlsGet(void* key);
+void naTlsSet(void* key, void* val);
+int naAtomicCAS(volatile int* p, int old, int val); // nonzero if swapped
+void* naAtomicSwap(void** p, void* val);
+int naAtomicCASRef(naRef* p, naRef old, naRef val); // compares the bits
+void naMemBarrier();
 
 void naCheckBottleneck();
+void naGC_release(struct Context* c);
+void naGC_collect(struct Context* c, int compact);
+void naGC_safepoint(struct Context* c);
+struct Context* naGC_run(struct Context* c);
+void naGC_ctxrefs(struct Context* c, void (*fn)(naRef*));
+
+// Whether a running thread should call naGC_safepoint().  Polled by
+// the interpreter at loop back-edges, function calls and returns.
+#define NEED_SAFEPOINT(g) ((g)->bottleneck || (g)->needCompact \
+                           || (g)->needEpoch || (g)->budgetHit || (g)->nfinal)
+void naArena_init();
+void naArena_bulk(int begin);
+void naArena_stats(long* used, long* size);
+long naArena_trim();
 
 #define LOCK() naLock(globals->lock)
 #define UNLOCK() naUnlock(globals->lock)
@@ -64,16 +64,20 @@ static int internConstant(struct Parser* p, naRef c)
     return newConstant(p, c);
 }
 
-/* FIXME: this API is fundamentally a resource leak, because symbols
- * can't be deregistered.  The "proper" way to do this would be to
- * keep a reference count for each symbol, and decrement it when a
- * code object referencing it is deleted. */
+/* The symbol table is a weak hash, so symbols no longer referenced
+ * by any code object or namespace get collected.  The caller may be
+ * holding the result only on the C stack, so the collector keeps it
+ * alive for a while longer (see naGC_holdsym()).  Anything keeping
+ * it in C memory for longer must root it itself. */
 naRef naInternSymbol(naRef sym)
 {
     naRef result;
     if(naHash_get(globals->symbols, sym, &result))
-        return result;
-    naHash_set(globals->symbols, sym, sym);
+        sym = result;
+    else
+        naHash_set(globals->symbols, sym, sym);
+    PTR(sym).str->sym = 1;
+    naGC_holdsym(sym);
     return sym;
 }
 
@@ -171,7 +175,9 @@ static void genArgList(struct Parser* p, struct naCode* c, struct Token* t)
             naParseError(p, "bad function argument expression", t->line);
         sym = naStr_fromdata(naNewString(p->context),
                              LEFT(t)->str, LEFT(t)->strlen);
+        // Only held in the C struct until the code object is done
         p->cg->restArgSym = naInternSymbol(sym);
+        naTempSave(p->context, p->cg->restArgSym);
         c->needArgVector = 1;
     } else if(t->type == TOK_ASSIGN) {
         if(LEFT(t)->type != TOK_SYMBOL)
@@ -0,0 +1,198 @@
+#include <string.h>
+
+#include "data.h"
+#include "code.h"
+
+// Coroutines.  Each runs its function in a context of its own.
+// yield() stops it by raising an error in that context, which leaves
+// it stopped at the call, and the next resume() carries on from there
+// with naContinueWith(), so that yield() returns the value passed in.
+// Like a thread's top level context, the coroutine's takes the mod
+// lock itself while it runs, so resume() drops the caller's.
+//
+// A suspended coroutine's context is detached: instead of being a GC
+// root, its stack is reached through the ghost.  So a generator that
+// is abandoned part way through is collected like anything else.
+
+#define CO_SUSPENDED 0 // including not yet started
+#define CO_RUNNING   1
+#define CO_DEAD      2
+
+struct Coro {
+    volatile int status;
+    naContext ctx;          // made by the first resume(), freed at the end
+    naRef fn;               // until started
+    naRef value;            // passed out by yield()
+    int yielded;
+    struct Coro* resumer;   // the coroutine running before this one, if any
+};
+
+static NA_THREAD_LOCAL struct Coro* current; // innermost running on this thread
+
+static void coroDestroy(void* p)
+{
+    struct Coro* co = p;
+    if(co->ctx) {
+        // Its references were left dangling by the collection that
+        // found the ghost unreachable
+        co->ctx->fTop = co->ctx->opTop = 0;
+        co->ctx->dieArg = naNil();
+        naFreeContext(co->ctx);
+    }
+    naFree(co);
+}
+
+static void coroRefs(void* p, void (*fn)(naRef*))
+{
+    struct Coro* co = p;
+    fn(&co->fn);
+    fn(&co->value);
+    if(co->ctx && co->ctx->detached) naGC_ctxrefs(co->ctx, fn);
+}
+
+static naRef coroNext(naContext c, void* p, int* done);
+
+static naGhostType CoroType = { coroDestroy, "coroutine", coroRefs, coroNext };
+
+static struct Coro* coroarg(naContext c, int argc, naRef* args,
+                            const char* name)
+{
+    if(argc < 1 || naGhost_type(args[0]) != &CoroType)
+        naRuntimeError(c, "coroutine.%s: bad/missing coroutine", name);
+    return naGhost_ptr(args[0]);
+}
+
+// Runs the coroutine until it yields or returns, giving back the
+// value yielded or returned and setting *done if it returned.  Args
+// go to the function the first time, after which the first is
+// returned by yield().  Errors in the coroutine are rethrown in c.
+static naRef resume(naContext c, struct Coro* co, int argc, naRef* args,
+                    int* done)
+{
+    naRef v, die;
+    char* err;
+    int start = !co->ctx;
+    if(!naAtomicCAS(&co->status, CO_SUSPENDED, CO_RUNNING))
+        naRuntimeError(c, co->status == CO_DEAD ? "cannot resume dead coroutine"
+                                               : "coroutine is already running");
+    if(start) {
+        co->ctx = naNewContext();
+        co->ctx->unsafe = 1;
+        v = co->fn;
+        co->fn = naNil();
+    } else {
+        v = argc > 0 ? args[0] : naNil();
+        co->ctx->detached = 0;
+    }
+    co->yielded = 0;
+    co->resumer = current;
+    current = co;
+
+    // v must stay put if a compaction runs before the call takes the
+    // mod lock, which the context's temps see to.  The arguments are
+    // on c's stack and are read after that.
+    naTempSave(co->ctx, v);
+    naModUnlock();
+    if(start) v = naCall(co->ctx, v, argc, args, naNil(), naNil());
+    else v = naContinueWith(co->ctx, v);
+    naModLock();
+    current = co->resumer;
+    co->resumer = 0;
+
+    if(co->yielded) {
+        v = co->value;
+        co->value = naNil();
+        co->ctx->ntemps = 0;
+        co->ctx->detached = 1;
+        co->status = CO_SUSPENDED;
+        *done = 0;
+        return v;
+    }
+
+    // Returned or failed, either way it's finished
+    die = naNil();
+    if((err = naGetError(co->ctx))) {
+        die = co->ctx->dieArg;
+        if(naIsNil(die)) die = naStr_fromdata(naNewString(c), err, strlen(err));
+    }
+    naFreeContext(co->ctx);
+    co->ctx = 0;
+    co->status = CO_DEAD;
+    if(err) {
+        c->dieArg = die;
+        naRuntimeError(c, "__die__");
+    }
+    *done = 1;
+    return v;
+}
+
+// foreach runs a coroutine as a generator, over the values it yields
+static naRef coroNext(naContext c, void* p, int* done)
+{
+    struct Coro* co = p;
+    if(co->status == CO_DEAD) {
+        *done = 1;
+        return naNil();
+    }
+    return resume(c, co, 0, 0, done);
+}
+
+static naRef f_create(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Coro* co;
+    if(argc < 1 || !naIsFunc(args[0]))
+        naRuntimeError(c, "coroutine.create: bad/missing function");
+    co = naAlloc(sizeof(*co));
+    naBZero(co, sizeof(*co));
+    co->status = CO_SUSPENDED;
+    co->fn = args[0];
+    co->value = naNil();
+    return naNewGhost(c, &CoroType, co);
+}
+
+static naRef f_resume(naContext c, naRef me, int argc, naRef* args)
+{
+    int done;
+    struct Coro* co = coroarg(c, argc, args, "resume");
+    return resume(c, co, argc - 1, args + 1, &done);
+}
+
+static naRef f_yield(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Coro* co = current;
+    if(!co || co->ctx != c)
+        naRuntimeError(c, "coroutine.yield: not called from a coroutine");
+    if(c->callChild) naFreeContext(c->callChild); // don't resume that
+    co->value = argc > 0 ? args[0] : naNil();
+    co->yielded = 1;
+    naRuntimeError(c, "coroutine: yield");
+    return naNil(); // never executes
+}
+
+static naRef f_status(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Coro* co = coroarg(c, argc, args, "status");
+    const char* s = co->status == CO_DEAD ? "dead"
+        : co->status == CO_RUNNING ? "running" : "suspended";
+    return naStr_fromdata(naNewString(c), s, strlen(s));
+}
+
+static naRef f_running(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Coro* co = current;
+    return co && co->ctx == c ? naNum(1) : naNum(0);
+}
+
+static naCFuncItem funcs[] = {
+    { "create", f_create },
+    { "resume", f_resume },
+    { "yield", f_yield },
+    { "status", f_status },
+    { "running", f_running },
+    { 0 }
+};
+
+naRef naInit_coroutine(naContext c)
+{
+    return naGenLib(c, funcs);
+}
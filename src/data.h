@@ -83,9 +83,9 @@ enum { T_STR, T_VEC, T_HASH, T_CODE, T_FUNC, T_CCODE, T_GHOST,
 // This is a macro instead of a separate struct to allow compilers to
 // avoid padding.  GCC on x86, at least, will always pad the size of
 // an embedded struct up to 32 bits.  Doing it this way allows the
-// implementing objects to pack in 16 bits worth of data "for free".
+// implementing objects to pack in 24 bits worth of data "for free".
+// Mark bits are kept by the collector in per-block bitmaps (gc.c).
 #define GC_HEADER \
-    unsigned char mark; \
     unsigned char type
 
 struct naObj {
@@ -96,6 +96,7 @@ struct naObj {
 struct naStr {
     GC_HEADER;
     char emblen; /* [0-15], or -1 to indicate "not embedded" */
+    unsigned char sym; /* interned by naInternSymbol() */
     unsigned int hashcode;
     union {
         unsigned char buf[16];
@@ -125,6 +126,10 @@ struct HashNode {
 
 struct naHash {
     GC_HEADER;
+    unsigned char weak; // entries live only as long as their keys
+    unsigned char shared; // written by several threads, see hash.c
+    unsigned char shaped; // an object, not yet a plain table, see hash.c
+    volatile int lock;    // held by a writer of a shared hash
     struct HashRec* rec;
 };
 
@@ -177,17 +182,22 @@ struct naPool {
     void**    free; // current "free frame"
     int      nfree; // down-counting index within the free frame
     int    freetop; // curr. top of the free list
+    int       peak; // decaying maximum of the live count, see trim()
 };
 
 void naFree(void* m);
 void* naAlloc(int n);
 void* naRealloc(void* buf, int sz);
 void naBZero(void* m, int n);
+void* naAllocAligned(int n, int align);
+void naFreeAligned(void* m);
+void naReleaseMemory();
 
 int naTypeSize(int type);
 naRef naObj(int type, struct naObj* o);
 naRef naNew(naContext c, int type);
 naRef naNewCode(naContext c);
+naRef naNewShapedHash(naContext c);
 
 int naStr_equal(naRef s1, naRef s2);
 naRef naStr_fromnum(naRef dest, double num);
@@ -199,10 +209,23 @@ naRef naStr_buf(naRef str, int len);
 int naiHash_tryset(naRef hash, naRef key, naRef val); // sets if exists
 int naiHash_sym(struct naHash* h, struct naStr* sym, naRef* out);
 void naiHash_newsym(struct naHash* h, naRef* sym, naRef* val);
+void naiHash_probes(naRef hash, int old, int* cells, double* mean,
+                    int* maxprobes, int* maxbucket); // see gc.hashstats()
 
 void naGC_init(struct naPool* p, int type);
 struct naObj** naGC_get(struct naPool* p, int n, int* nout);
 void naGC_swapfree(void** target, void* val);
+void naGC_holdsym(naRef sym);
+
+// Storage for string data, VecRecs and HashRecs.  See arena.c
+void* naArena_alloc(int n);
+void naArena_free(void* m);
+
+// Charge storage to the running context's memory budget, see gc.c
+void naGC_spend(int objects, long bytes);
+void naGC_count(long bytes);
+void naGC_reserve(naContext ctx, long bytes);
+int naArena_size(void* m);
 void naGC_freedead();
 void naiGCMark(naRef r);
 void naiGCMarkHash(naRef h);
@@ -210,5 +233,9 @@ void naiGCMarkHash(naRef h);
 void naStr_gcclean(struct naStr* s);
 void naVec_gcclean(struct naVec* s);
 void naiGCHashClean(struct naHash* h);
+void naiGCHashRefs(struct naHash* h, void (*fn)(naRef*));
+void naiGCHashPairs(struct naHash* h, void (*fn)(naRef, naRef));
+void naiGCHashSweep(struct naHash* h, int (*live)(naRef));
+void naiGCShapeKeys(void (*fn)(naRef));
 
 #endif // _DATA_H
@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include "data.h"
+#include "code.h"
+#include "iolib.h"
+
+// Event loops: each watches file descriptors with epoll, runs timers
+// and runs tasks.  A task is a function started by spawn() in a
+// context of its own.  When it calls read(), write(), wait() or
+// sleep() and would have to block, the C function notes what it was
+// doing, parks the task on the descriptor or a timer and raises an
+// error, leaving the context stopped at the call.  The loop finishes
+// the operation when the descriptor is ready and resumes the task
+// with naContinueWith(), so the call returns its result as if it had
+// blocked.  A parked task costs only its context, so thousands of
+// them can share one thread.
+//
+// A loop belongs to the thread running it.  Tasks run as top level
+// contexts, with the mod lock dropped by run() and taken by
+// naCall()/naContinueWith() as usual.  Callbacks from watch() and
+// timer() run in a subcontext of run()'s, and can't be suspended.
+
+#define OP_NONE  0 // running, or parked on a timer
+#define OP_START 1 // spawned, not yet run
+#define OP_READ  2
+#define OP_WRITE 3
+#define OP_WAIT  4
+
+struct Loop;
+
+struct Task {
+    struct Loop* loop;
+    naContext ctx;
+    int op, fd, dir;
+    int len, off;       // for OP_READ and OP_WRITE
+    naRef job;          // [fn, args...] until started
+    naRef str;          // the data for OP_WRITE
+    naRef value;        // the suspended call's result, once resumed
+    int parked;         // set when the task suspends itself
+    struct Task* next;  // in the run queue
+};
+
+struct Watch {
+    naRef fn[2];          // callbacks for readable and writable, or...
+    struct Task* task[2]; // ...tasks waiting for the same
+    int events;           // as registered with epoll
+};
+
+struct Timer {
+    double when, every;
+    int id;
+    naRef fn;             // nil if cancelled, or for a sleeping task
+    struct Task* task;
+};
+
+struct Loop {
+    int epfd;
+    struct Watch* fds;    // indexed by descriptor
+    int nfds;
+    struct Timer* timers; // binary heap, soonest first
+    int ntimers, timersz;
+    int nextid;
+    int waiting;          // callbacks and parked tasks on descriptors
+    int live;             // timers not cancelled, and sleeping tasks
+    struct Task *head, *tail; // ready to run
+    struct Task* running;
+    int stop;
+};
+
+static NA_THREAD_LOCAL struct Task* current; // being run by this thread
+
+static void taskrefs(struct Task* t, void (*fn)(naRef*))
+{
+    fn(&t->job);
+    fn(&t->str);
+    fn(&t->value);
+}
+
+static void loopRefs(void* p, void (*fn)(naRef*))
+{
+    int i, d;
+    struct Loop* l = p;
+    struct Task* t;
+    for(t = l->head; t; t = t->next)
+        taskrefs(t, fn);
+    if(l->running) taskrefs(l->running, fn);
+    for(i=0; i<l->nfds; i++) {
+        for(d=0; d<2; d++) {
+            fn(&l->fds[i].fn[d]);
+            if(l->fds[i].task[d]) taskrefs(l->fds[i].task[d], fn);
+        }
+    }
+    for(i=0; i<l->ntimers; i++) {
+        fn(&l->timers[i].fn);
+        if(l->timers[i].task) taskrefs(l->timers[i].task, fn);
+    }
+}
+
+static void freetask(struct Task* t)
+{
+    if(t->ctx) naFreeContext(t->ctx);
+    naFree(t);
+}
+
+// Tasks still parked when the loop goes away are never resumed
+static void loopDestroy(void* p)
+{
+    int i, d;
+    struct Loop* l = p;
+    struct Task* t;
+    close(l->epfd);
+    while((t = l->head)) {
+        l->head = t->next;
+        freetask(t);
+    }
+    for(i=0; i<l->nfds; i++)
+        for(d=0; d<2; d++)
+            if(l->fds[i].task[d]) freetask(l->fds[i].task[d]);
+    for(i=0; i<l->ntimers; i++)
+        if(l->timers[i].task) freetask(l->timers[i].task);
+    naFree(l->fds);
+    naFree(l->timers);
+    naFree(l);
+}
+
+static naGhostType LoopType = { loopDestroy, "loop", loopRefs };
+
+static struct Loop* looparg(naContext c, int argc, naRef* args,
+                            const char* name)
+{
+    if(argc < 1 || naGhost_type(args[0]) != &LoopType)
+        naRuntimeError(c, "event.%s: bad/missing loop", name);
+    return naGhost_ptr(args[0]);
+}
+
+// Descriptors are numbers, or files from the io and unix modules
+static int fdarg(naContext c, int argc, naRef* args, int n, const char* name)
+{
+    naRef r = argc > n ? args[n] : naNil();
+    if(IS_STDIO(r)) return fileno((FILE*)IOGHOST(r)->handle);
+    r = naNumValue(r);
+    if(naIsNil(r) || r.num < 0)
+        naRuntimeError(c, "event.%s: bad descriptor", name);
+    return (int)r.num;
+}
+
+// "r" or "w", for readable or writable
+static int dirarg(naContext c, int argc, naRef* args, int n, const char* name)
+{
+    naRef r = argc > n ? args[n] : naNil();
+    if(naIsString(r) && naStr_len(r) == 1) {
+        if(naStr_data(r)[0] == 'r') return 0;
+        if(naStr_data(r)[0] == 'w') return 1;
+    }
+    naRuntimeError(c, "event.%s: mode must be \"r\" or \"w\"", name);
+    return 0;
+}
+
+static void nonblock(int fd)
+{
+    int fl = fcntl(fd, F_GETFL);
+    if(fl >= 0 && !(fl & O_NONBLOCK)) fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+static int wouldblock() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+
+static struct Watch* getwatch(struct Loop* l, int fd)
+{
+    if(fd >= l->nfds) {
+        int i, n = l->nfds ? l->nfds : 16;
+        while(n <= fd) n *= 2;
+        l->fds = naRealloc(l->fds, n * sizeof(struct Watch));
+        for(i=l->nfds; i<n; i++) {
+            l->fds[i].fn[0] = l->fds[i].fn[1] = naNil();
+            l->fds[i].task[0] = l->fds[i].task[1] = 0;
+            l->fds[i].events = 0;
+        }
+        l->nfds = n;
+    }
+    return &l->fds[fd];
+}
+
+static int inuse(struct Watch* w, int d) { return w->task[d] || !naIsNil(w->fn[d]); }
+
+// Brings the epoll registration in line with the watch, returning
+// zero (with errno set) if the descriptor can't be watched
+static int update(struct Loop* l, int fd)
+{
+    struct Watch* w = &l->fds[fd];
+    struct epoll_event ev;
+    int op, want = (inuse(w, 0) ? EPOLLIN : 0) | (inuse(w, 1) ? EPOLLOUT : 0);
+    if(want == w->events) return 1;
+    op = !w->events ? EPOLL_CTL_ADD : want ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    naBZero(&ev, sizeof(ev));
+    ev.events = want;
+    ev.data.fd = fd;
+    if(epoll_ctl(l->epfd, op, fd, &ev) < 0) {
+        // Closing a descriptor drops it from the epoll set, and the
+        // number may since have been reused
+        if(op == EPOLL_CTL_MOD && errno == ENOENT) {
+            if(epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) return 0;
+        } else if(op != EPOLL_CTL_DEL) {
+            return 0;
+        }
+    }
+    w->events = want;
+    return 1;
+}
+
+static void ready(struct Loop* l, struct Task* t, naRef value)
+{
+    t->value = value;
+    t->next = 0;
+    if(l->tail) l->tail->next = t;
+    else l->head = t;
+    l->tail = t;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Timers
+
+static int before(struct Timer* a, struct Timer* b)
+{
+    return a->when < b->when || (a->when == b->when && a->id < b->id);
+}
+
+static void addtimer(struct Loop* l, struct Timer* tm)
+{
+    int i;
+    if(l->ntimers == l->timersz) {
+        l->timersz = l->timersz ? 2*l->timersz : 16;
+        l->timers = naRealloc(l->timers, l->timersz * sizeof(struct Timer));
+    }
+    for(i = l->ntimers++; i > 0 && before(tm, &l->timers[(i-1)/2]); i = (i-1)/2)
+        l->timers[i] = l->timers[(i-1)/2];
+    l->timers[i] = *tm;
+    l->live++;
+}
+
+static void poptimer(struct Loop* l, struct Timer* out)
+{
+    int i = 0, k;
+    struct Timer last = l->timers[--l->ntimers];
+    *out = l->timers[0];
+    while((k = 2*i + 1) < l->ntimers) {
+        if(k+1 < l->ntimers && before(&l->timers[k+1], &l->timers[k])) k++;
+        if(!before(&l->timers[k], &last)) break;
+        l->timers[i] = l->timers[k];
+        i = k;
+    }
+    if(l->ntimers) l->timers[i] = last;
+}
+
+// Milliseconds until the next timer is due, or -1 for none
+static int timeout(struct Loop* l)
+{
+    double ms;
+    if(!l->ntimers) return -1;
+    ms = (l->timers[0].when - naTime()) * 1000 + 0.999;
+    return ms <= 0 ? 0 : ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+static void callback(naContext c, naRef fn, naRef arg)
+{
+    naContext subc = naSubContext(c);
+    naCall(subc, fn, 1, &arg, naNil(), naNil());
+    if(naGetError(subc)) naRethrowError(subc);
+    naFreeContext(subc);
+}
+
+static void firetimers(naContext c, struct Loop* l)
+{
+    struct Timer tm;
+    double now = naTime();
+    while(l->ntimers && l->timers[0].when <= now && !l->stop) {
+        poptimer(l, &tm);
+        if(tm.task) {
+            l->live--;
+            ready(l, tm.task, naNil());
+        } else if(!naIsNil(tm.fn)) {
+            l->live--;
+            if(tm.every > 0) {
+                tm.when += tm.every;
+                if(tm.when <= now) tm.when = now + tm.every;
+                addtimer(l, &tm);
+            }
+            callback(c, tm.fn, naNum(tm.id));
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Tasks
+
+static struct Task* curtask(naContext c, const char* name)
+{
+    if(!current || current->ctx != c)
+        naRuntimeError(c, "event.%s: not called from a task", name);
+    return current;
+}
+
+// Doesn't return: the error unwinds the task to run(), which sees it
+// was parked rather than failed
+static void suspend(naContext c, struct Task* t)
+{
+    if(c->callChild) naFreeContext(c->callChild); // don't resume that
+    t->parked = 1;
+    naRuntimeError(c, "event: task suspended");
+}
+
+static void park(naContext c, struct Task* t, int op, int fd, int dir,
+                 const char* name)
+{
+    struct Watch* w = getwatch(t->loop, fd);
+    if(inuse(w, dir))
+        naRuntimeError(c, "event.%s: descriptor %d already watched", name, fd);
+    w->task[dir] = t;
+    if(!update(t->loop, fd)) {
+        w->task[dir] = 0;
+        naRuntimeError(c, "event.%s: %s", name, strerror(errno));
+    }
+    t->op = op;
+    t->fd = fd;
+    t->dir = dir;
+    t->loop->waiting++;
+    suspend(c, t);
+}
+
+// Retries the parked task's operation now its descriptor is ready.
+// If it's done, the task goes back on the run queue with the result.
+static void finish(naContext c, struct Loop* l, struct Task* t)
+{
+    int n;
+    char* buf;
+    naRef result = naNil();
+    if(t->op == OP_READ) {
+        buf = naAlloc(t->len);
+        n = read(t->fd, buf, t->len);
+        if(n < 0 && wouldblock()) { naFree(buf); return; }
+        if(n > 0) result = naStr_fromdata(naNewString(c), buf, n);
+        naFree(buf);
+    } else if(t->op == OP_WRITE) {
+        n = write(t->fd, naStr_data(t->str) + t->off, t->len - t->off);
+        if(n < 0 && wouldblock()) return;
+        if(n > 0 && (t->off += n) < t->len) return;
+        result = naNum(t->off);
+        t->str = naNil();
+    } else {
+        result = naNum(1);
+    }
+    l->fds[t->fd].task[t->dir] = 0;
+    update(l, t->fd);
+    l->waiting--;
+    t->op = OP_NONE;
+    ready(l, t, result);
+}
+
+// Runs the task at the head of the queue until it finishes or parks
+// itself again.  An error in the task is rethrown from run().
+static void runtask(naContext c, struct Loop* l)
+{
+    struct Task *t = l->head, *prevtask = current, *prevrun = l->running;
+    struct VecRec* vr = 0;
+    naRef val, die;
+    char* err;
+    l->head = t->next;
+    if(!l->head) l->tail = 0;
+    t->parked = 0;
+    l->running = current = t;
+
+    // What's passed by value must stay put if a compaction runs
+    // before the call takes the mod lock, which the task's temps do.
+    // The arguments are read from the job's array after that.
+    if(t->op == OP_START) {
+        vr = PTR(t->job).vec->rec;
+        val = vr->array[0];
+        t->op = OP_NONE;
+    } else {
+        val = t->value;
+    }
+    naTempSave(t->ctx, val);
+    naModUnlock();
+    if(vr) naCall(t->ctx, val, vr->size - 1, vr->array + 1, naNil(), naNil());
+    else naContinueWith(t->ctx, val);
+    naModLock();
+    l->running = prevrun;
+    current = prevtask;
+    t->job = t->value = naNil();
+    if(t->parked) return;
+
+    if((err = naGetError(t->ctx))) {
+        die = t->ctx->dieArg;
+        if(naIsNil(die)) die = naStr_fromdata(naNewString(c), err, strlen(err));
+        freetask(t);
+        c->dieArg = die;
+        naRuntimeError(c, "__die__");
+    }
+    freetask(t);
+}
+
+static void dispatch(naContext c, struct Loop* l, int fd, int events)
+{
+    int d;
+    for(d=0; d<2; d++) {
+        struct Watch* w = &l->fds[fd]; // callbacks can move it
+        if(!inuse(w, d) || !(events & ((d ? EPOLLOUT : EPOLLIN)|EPOLLERR|EPOLLHUP)))
+            continue;
+        if(w->task[d]) finish(c, l, w->task[d]);
+        else if(!naIsNil(w->fn[d])) callback(c, w->fn[d], naNum(fd));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Script API
+
+static naRef f_newloop(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Loop* l;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0) naRuntimeError(c, "event.newloop: %s", strerror(errno));
+    l = naAlloc(sizeof(*l));
+    naBZero(l, sizeof(*l));
+    l->epfd = epfd;
+    return naNewGhost(c, &LoopType, l);
+}
+
+static naRef f_spawn(naContext c, naRef me, int argc, naRef* args)
+{
+    int i;
+    struct Task* t;
+    struct Loop* l = looparg(c, argc, args, "spawn");
+    naRef job;
+    if(argc < 2 || !naIsFunc(args[1]))
+        naRuntimeError(c, "event.spawn: bad/missing function");
+    job = naNewVector(c);
+    for(i=1; i<argc; i++)
+        naVec_append(job, args[i]);
+    t = naAlloc(sizeof(*t));
+    naBZero(t, sizeof(*t));
+    t->loop = l;
+    t->op = OP_START;
+    t->job = job;
+    t->str = t->value = naNil();
+    t->ctx = naNewContext();
+    t->ctx->unsafe = 1;
+    ready(l, t, naNil());
+    return naNil();
+}
+
+static naRef f_run(naContext c, naRef me, int argc, naRef* args)
+{
+    int i, n;
+    struct epoll_event evs[256];
+    struct Loop* l = looparg(c, argc, args, "run");
+    l->stop = 0;
+    while(1) {
+        while(l->head && !l->stop) runtask(c, l);
+        firetimers(c, l);
+        if(l->stop || !(l->head || l->waiting || l->live)) break;
+        naEnterNative();
+        n = epoll_wait(l->epfd, evs, 256, l->head ? 0 : timeout(l));
+        naLeaveNative();
+        for(i=0; i<n && !l->stop; i++)
+            dispatch(c, l, evs[i].data.fd, evs[i].events);
+    }
+    l->stop = 0;
+    return naNil();
+}
+
+static naRef f_stop(naContext c, naRef me, int argc, naRef* args)
+{
+    looparg(c, argc, args, "stop")->stop = 1;
+    return naNil();
+}
+
+static naRef f_watch(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Loop* l = looparg(c, argc, args, "watch");
+    int fd = fdarg(c, argc, args, 1, "watch");
+    int d = dirarg(c, argc, args, 2, "watch");
+    struct Watch* w = getwatch(l, fd);
+    if(argc < 4 || !naIsFunc(args[3]))
+        naRuntimeError(c, "event.watch: bad/missing function");
+    if(inuse(w, d))
+        naRuntimeError(c, "event.watch: descriptor %d already watched", fd);
+    w->fn[d] = args[3];
+    if(!update(l, fd)) {
+        w->fn[d] = naNil();
+        naRuntimeError(c, "event.watch: %s", strerror(errno));
+    }
+    l->waiting++;
+    return naNil();
+}
+
+static naRef f_unwatch(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Loop* l = looparg(c, argc, args, "unwatch");
+    int fd = fdarg(c, argc, args, 1, "unwatch");
+    int d = dirarg(c, argc, args, 2, "unwatch");
+    if(fd < l->nfds && !naIsNil(l->fds[fd].fn[d])) {
+        l->fds[fd].fn[d] = naNil();
+        update(l, fd);
+        l->waiting--;
+    }
+    return naNil();
+}
+
+static naRef f_timer(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Timer tm;
+    struct Loop* l = looparg(c, argc, args, "timer");
+    naRef delay = argc > 1 ? naNumValue(args[1]) : naNil();
+    naRef every = argc > 3 ? naNumValue(args[3]) : naNum(0);
+    if(naIsNil(delay) || naIsNil(every) || delay.num < 0 || every.num < 0
+       || argc < 3 || !naIsFunc(args[2]))
+        naRuntimeError(c, "bad/missing argument to event.timer");
+    tm.when = naTime() + delay.num;
+    tm.every = every.num;
+    tm.id = ++l->nextid;
+    tm.fn = args[2];
+    tm.task = 0;
+    addtimer(l, &tm);
+    return naNum(tm.id);
+}
+
+static naRef f_cancel(naContext c, naRef me, int argc, naRef* args)
+{
+    int i;
+    struct Loop* l = looparg(c, argc, args, "cancel");
+    naRef id = argc > 1 ? naNumValue(args[1]) : naNil();
+    if(naIsNil(id)) naRuntimeError(c, "event.cancel: bad timer");
+    for(i=0; i<l->ntimers; i++) {
+        struct Timer* tm = &l->timers[i];
+        if(tm->id == (int)id.num && !tm->task && !naIsNil(tm->fn)) {
+            tm->fn = naNil();
+            l->live--;
+            return naNum(1);
+        }
+    }
+    return naNum(0);
+}
+
+static naRef f_read(naContext c, naRef me, int argc, naRef* args)
+{
+    int n, fd = fdarg(c, argc, args, 0, "read");
+    naRef len = argc > 1 ? naNumValue(args[1]) : naNil();
+    struct Task* t = curtask(c, "read");
+    char* buf;
+    naRef result = naNil();
+    if(naIsNil(len) || len.num < 1)
+        naRuntimeError(c, "event.read: bad length");
+    nonblock(fd);
+    buf = naAlloc((int)len.num);
+    n = read(fd, buf, (int)len.num);
+    if(n > 0) result = naStr_fromdata(naNewString(c), buf, n);
+    naFree(buf);
+    if(n < 0 && wouldblock()) {
+        t->len = (int)len.num;
+        park(c, t, OP_READ, fd, 0, "read");
+    }
+    return result;
+}
+
+static naRef f_write(naContext c, naRef me, int argc, naRef* args)
+{
+    int n, len, fd = fdarg(c, argc, args, 0, "write");
+    naRef str = argc > 1 ? args[1] : naNil();
+    struct Task* t = curtask(c, "write");
+    if(!naIsString(str)) naRuntimeError(c, "event.write: bad string");
+    len = naStr_len(str);
+    nonblock(fd);
+    n = write(fd, naStr_data(str), len);
+    if(n < 0 && !wouldblock()) return naNum(0);
+    if(n < 0) n = 0;
+    if(n < len) {
+        t->str = str;
+        t->len = len;
+        t->off = n;
+        park(c, t, OP_WRITE, fd, 1, "write");
+    }
+    return naNum(n);
+}
+
+static naRef f_wait(naContext c, naRef me, int argc, naRef* args)
+{
+    int fd = fdarg(c, argc, args, 0, "wait");
+    int d = dirarg(c, argc, args, 1, "wait");
+    struct Task* t = curtask(c, "wait");
+    struct pollfd p;
+    p.fd = fd;
+    p.events = d ? POLLOUT : POLLIN;
+    if(poll(&p, 1, 0) > 0) return naNum(1);
+    park(c, t, OP_WAIT, fd, d, "wait");
+    return naNil(); // never executes
+}
+
+static naRef f_sleep(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Timer tm;
+    naRef secs = argc > 0 ? naNumValue(args[0]) : naNil();
+    struct Task* t = curtask(c, "sleep");
+    if(naIsNil(secs) || secs.num < 0)
+        naRuntimeError(c, "event.sleep: bad time");
+    tm.when = naTime() + secs.num;
+    tm.every = 0;
+    tm.id = ++t->loop->nextid;
+    tm.fn = naNil();
+    tm.task = t;
+    addtimer(t->loop, &tm);
+    suspend(c, t);
+    return naNil(); // never executes
+}
+
+static naCFuncItem funcs[] = {
+    { "newloop", f_newloop },
+    { "spawn", f_spawn },
+    { "run", f_run },
+    { "stop", f_stop },
+    { "watch", f_watch },
+    { "unwatch", f_unwatch },
+    { "timer", f_timer },
+    { "cancel", f_cancel },
+    { "read", f_read },
+    { "write", f_write },
+    { "wait", f_wait },
+    { "sleep", f_sleep },
+    { 0 }
+};
+
+naRef naInit_event(naContext c)
+{
+    return naGenLib(c, funcs);
+}
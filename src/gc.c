@@ -1,118 +1,369 @@
+#include <stdio.h>
+#include <string.h>
 #include "nasal.h"
 #include "data.h"
 #include "code.h"
 
 #define MIN_BLOCK_SIZE 32
 
+// Objects live in fixed size blocks aligned on a BLOCK_SIZE boundary,
+// so the block holding any object can be found by masking its
+// address.  Blocks left empty by a collection can be freed
+// individually.
+#define BLOCK_SIZE (32*1024)
+#define BLOCK_HDR ((sizeof(struct Block) + 15) & ~15)
+#define BLOCKOF(o) ((struct Block*)((size_t)(o) & ~(size_t)(BLOCK_SIZE-1)))
+#define OBJAT(p, b, i) ((struct naObj*)((b)->block + (i)*(p)->elemsz))
+
+// Mark state lives in bitmaps in the block header rather than in the
+// objects, so marking doesn't write to object memory and sweeping
+// doesn't touch it at all except to clean up dead objects.  There is
+// a bit per 16 byte granule (the smallest object size), so every
+// object has its own: the one for the granule it starts in.  BITOBJ
+// maps a bit back to the object starting there.
+#define GRAIN 16
+#define MAPWORDS (BLOCK_SIZE/GRAIN/32)
+#define BITOF(b, o) ((unsigned int)((char*)(o) - (b)->block) / GRAIN)
+#define BITOBJ(p, b, i) OBJAT(p, b, ((i)*GRAIN + (p)->elemsz - 1) / (p)->elemsz)
+#define TESTBIT(m, i) ((m)[(i)>>5] & (1u << ((i)&31)))
+#define SETBIT(m, i) ((m)[(i)>>5] |= (1u << ((i)&31)))
+
+// Compaction: a collection can evacuate the live objects out of
+// sparse blocks so the blocks can be freed.  Only objects that are
+// referenced solely through naRefs are moved: code objects are
+// pointed to from the interpreter's C stack, and the others are
+// handed to C code.  A marked object in a block being released has
+// been moved, and holds its new address after the header.
+#define MOVABLE(t) ((t)==T_STR || (t)==T_VEC || (t)==T_HASH || (t)==T_FUNC)
+#define FWD(o) (((struct naObj**)(o))[1])
+
+// Whether objects may move under a thread stopped while running c
+#define SAFE(c) (!(c)->callParent && !(c)->unsafe)
+
+// Don't bother stopping the world to compact fewer sparse blocks
+#define COMPACT_MIN_BLOCKS 4
+
+// Ask the C library to return memory after freeing this much
+#define RELEASE_TRIGGER (4*1024*1024)
+
 static void reap(struct naPool* p);
+static int trim(struct naPool* p, long* freed);
+static void noteallocs(struct naPool* p);
 static void mark(naRef r);
+static void markslot(naRef* r) { mark(*r); }
+static void markweak();
+static void markbudgets();
+static void budgeterror(struct Context* c, struct Context* ctx);
+static void agesyms();
+static void evacuate(struct naPool* p);
+static void fixrefs(struct naPool* p);
+static void snapshot(FILE* f);
+static void freeRetired();
+static struct EpochRec* threadrec();
+static struct EpochRec* currec();
+static void quiesce(struct EpochRec* r);
 
 struct Block {
-    int   size;
-    char* block;
     struct Block* next;
+    char* block;   // first object
+    int   size;    // number of objects
+    int   live;    // marked objects, counted by the last sweep
+    char  pinned;  // holds an object C code may point to
+    char  release; // to be freed at the end of this collection
+    unsigned int mark[MAPWORDS]; // reached by the current collection
+    unsigned int used[MAPWORDS]; // may own storage needing cleanup
 };
 
+// Per-thread state for deferred freeing, see naGC_swapfree()
+#define EPOCH_BUCKETS 3
+#define EPOCH_ADVANCE 32 // blocks retired between attempts to advance
+
+struct EpochRec {
+    struct EpochRec* next;
+    volatile unsigned int epoch; // global epoch at the last quiescent point
+    volatile int active;         // mod locks held by the thread
+    int native;                  // naEnterNative() depth
+    volatile int dead;           // the thread has exited
+    int nlimbo;                  // retired blocks, over all buckets
+    int retires;                 // blocks retired since trying to advance
+    struct { unsigned int epoch; int n, sz; void** blocks; } limbo[EPOCH_BUCKETS];
+};
+
+// The bits for the object start granules of a full block, per type
+static unsigned int starts[NUM_NASAL_TYPES][MAPWORDS];
+
+static int lowbit(unsigned int w)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(w);
+#else
+    int i = 0;
+    while(!(w & 1)) { w >>= 1; i++; }
+    return i;
+#endif
+}
+
+static int popcount(unsigned int w)
+{
+#ifdef __GNUC__
+    return __builtin_popcount(w);
+#else
+    int n = 0;
+    while(w) { w &= w - 1; n++; }
+    return n;
+#endif
+}
+
 // Must be called with the giant exclusive lock!
 static void freeDead()
 {
+    struct Globals* g = globals;
     int i;
-    for(i=0; i<globals->ndead; i++)
-        naFree(globals->deadBlocks[i]);
-    globals->ndead = 0;
+    for(i=0; i<g->ndead; i++)
+        naArena_free(g->deadBlocks[i]);
+    g->ndead = 0;
+    freeRetired();
 }
 
-static void marktemps(struct Context* c)
+// Calls fn on every root reference.  If kind is not null, it is
+// first told what sort of root each one is.
+#define ROOT(k, r) do { if(kind) kind(k); fn(r); } while(0)
+static void ctxroots(struct Context* c, void (*fn)(naRef),
+                     void (*kind)(const char*))
 {
     int i;
     naRef r = naNil();
+    if(c->detached) return;
+    for(i=0; i < c->fTop; i++) {
+        ROOT("func", c->fStack[i].func);
+        ROOT("locals", c->fStack[i].locals);
+    }
+    for(i=0; i < c->opTop; i++)
+        ROOT("stack", c->opStack[i]);
+    ROOT("die", c->dieArg);
     for(i=0; i<c->ntemps; i++) {
         SETPTR(r, c->temps[i]);
-        mark(r);
+        ROOT("temp", r);
     }
 }
 
+// For the ghost owning a detached context (a suspended coroutine,
+// say): its stack is reachable only through the ghost's refs hook,
+// which passes each reference on to fn here.  The temps are cleared
+// when the context is detached.
+void naGC_ctxrefs(struct Context* c, void (*fn)(naRef*))
+{
+    int i;
+    for(i=0; i < c->fTop; i++) {
+        fn(&c->fStack[i].func);
+        fn(&c->fStack[i].locals);
+    }
+    for(i=0; i < c->opTop; i++)
+        fn(&c->opStack[i]);
+    fn(&c->dieArg);
+}
+
+static void roots(void (*fn)(naRef), void (*kind)(const char*))
+{
+    struct Globals* g = globals;
+    int i;
+    struct Context* c;
+    for(c = g->allContexts; c; c = c->nextAll)
+        ctxroots(c, fn, kind);
+    ROOT("save", g->save);
+    ROOT("symbols", g->symbols);
+    for(i=0; i<g->nHeldSyms; i++)
+        ROOT("symbols", g->heldSyms[i]);
+    for(i=0; i<g->nCRoots; i++)
+        ROOT("held", g->cRoots[i]);
+    ROOT("const", g->meRef);
+    ROOT("const", g->argRef);
+    ROOT("const", g->parentsRef);
+    if(kind) kind("shape");
+    naiGCShapeKeys(fn);
+}
+#undef ROOT
+
+static void pin(naRef r)
+{
+    if(IS_OBJ(r)) BLOCKOF(PTR(r).obj)->pinned = 1;
+}
+
+static void pinslot(naRef* r) { pin(*r); }
+
+// Pins the blocks holding anything C code might have a pointer to:
+// the roots themselves, naSave()'d objects and interned symbols.
+static void pinroots()
+{
+    struct Globals* g = globals;
+    int i;
+    struct Block* b;
+    struct VecRec* vr = PTR(g->save).vec->rec;
+    for(i=0; i<NUM_NASAL_TYPES; i++)
+        for(b = g->pools[i].blocks; b; b = b->next)
+            b->pinned = 0;
+    roots(pin, 0);
+    for(i=0; vr && i<vr->size; i++)
+        pin(vr->array[i]);
+    naiGCHashRefs(PTR(g->symbols).hash, pinslot);
+}
+
 // Must be called with the big lock!
 static void garbageCollect()
 {
-    int i;
+    struct Globals* g = globals;
+    int i, sparse = 0, compact = g->needCompact;
+    long freed = 0;
     struct Context* c;
-    globals->allocCount = 0;
-    c = globals->allContexts;
-    while(c) {
+    g->allocCount = 0;
+    g->stats.collections++;
+    for(c = g->allContexts; c; c = c->nextAll)
         for(i=0; i<NUM_NASAL_TYPES; i++)
             c->nfree[i] = 0;
-        for(i=0; i < c->fTop; i++) {
-            mark(c->fStack[i].func);
-            mark(c->fStack[i].locals);
-        }
-        for(i=0; i < c->opTop; i++)
-            mark(c->opStack[i]);
-        mark(c->dieArg);
-        marktemps(c);
-        c = c->nextAll;
-    }
 
-    mark(globals->save);
-    mark(globals->symbols);
-    mark(globals->meRef);
-    mark(globals->argRef);
-    mark(globals->parentsRef);
+    for(i=0; i<NUM_NASAL_TYPES; i++)
+        noteallocs(&g->pools[i]);
+    if(compact) pinroots();
+    markbudgets();
+    roots(mark, 0);
+    markweak();
+    agesyms();
 
-    // Finally collect all the freed objects
+    if(compact) {
+        g->stats.compactions++;
+        g->lastCompact = g->stats.collections;
+        for(i=0; i<NUM_NASAL_TYPES; i++)
+            evacuate(&g->pools[i]);
+        for(i=0; i<NUM_NASAL_TYPES; i++)
+            fixrefs(&g->pools[i]);
+    }
+
+    // Finally collect all the freed objects, and give back what
+    // isn't needed
+    for(i=0; i<NUM_NASAL_TYPES; i++)
+        reap(&(g->pools[i]));
     for(i=0; i<NUM_NASAL_TYPES; i++)
-        reap(&(globals->pools[i]));
+        sparse += trim(&(g->pools[i]), &freed);
+    freed += naArena_trim();
+    g->stats.released += freed;
+    if(freed >= RELEASE_TRIGGER)
+        naReleaseMemory();
+
+    // Schedule a compaction for the next safe point if it looks
+    // worthwhile and there hasn't been one recently
+    g->needCompact = !compact && g->tuning.compact > 0
+        && sparse >= COMPACT_MIN_BLOCKS
+        && g->stats.collections >= g->lastCompact + 8;
 
     // Make enough space for the dead blocks we need to free during
     // execution.  This works out to 1 spot for every 2 live objects,
     // which should be limit the number of bottleneck operations
     // without imposing an undue burden of extra "freeable" memory.
-    if(globals->deadsz < globals->allocCount) {
-        globals->deadsz = globals->allocCount;
-        if(globals->deadsz < 256) globals->deadsz = 256;
-        naFree(globals->deadBlocks);
-        globals->deadBlocks = naAlloc(sizeof(void*) * globals->deadsz);
+    if(g->deadsz < g->allocCount) {
+        g->deadsz = g->allocCount;
+        if(g->deadsz < 256) g->deadsz = 256;
+        naFree(g->deadBlocks);
+        g->deadBlocks = naAlloc(sizeof(void*) * g->deadsz);
     }
-    globals->needGC = 0;
+    g->needGC = 0;
 }
 
 void naModLock()
 {
-    LOCK();
-    globals->nThreads++;
-    UNLOCK();
+    struct Globals* g = globals;
+    struct EpochRec* r;
+    naLock(g->lock);
+    g->nThreads++;
+    r = threadrec();
+    r->active++;
+    r->epoch = g->epoch;
+    naUnlock(g->lock);
+    naMemBarrier();
     naCheckBottleneck();
 }
 
 void naModUnlock()
 {
-    LOCK();
-    globals->nThreads--;
+    struct Globals* g = globals;
+    struct EpochRec* r = currec();
+    naLock(g->lock);
+    g->nThreads--;
+    if(r && r->active) r->active--;
     // We might be the "last" thread needed for collection.  Since
     // we're releasing our modlock to do something else for a while,
     // wake someone else up to do it.
-    if(globals->waitCount == globals->nThreads)
-        naSemUp(globals->sem, 1);
-    UNLOCK();
+    if(g->waitCount == g->nThreads)
+        naSemUp(g->sem, 1);
+    naUnlock(g->lock);
+}
+
+// The "native" state: a thread that gives up its mod lock around a
+// blocking call counts as stopped for every bottleneck until it takes
+// it back.  Nests, unlike naModUnlock().
+void naEnterNative()
+{
+    struct Globals* g = globals;
+    struct EpochRec* r = currec();
+    if(r && r->native++) return;
+    naLock(g->lock); g->nNative++; naUnlock(g->lock);
+    naModUnlock();
+}
+
+void naLeaveNative()
+{
+    struct Globals* g = globals;
+    struct EpochRec* r = currec();
+    if(r && --r->native) return;
+    naModLock();
+    naLock(g->lock); g->nNative--; naUnlock(g->lock);
 }
 
 // Must be called with the main lock.  Engages the "bottleneck", where
 // all threads will block so that one (the last one to call this
 // function) can run alone.  This is done for GC, and also to free the
 // list of "dead" blocks when it gets full (which is part of GC, if
-// you think about it).
-static void bottleneck()
+// you think about it).  The safe flag says the calling thread is at a
+// point where a compacting collection may move objects under it.
+static void bottleneck(int safe)
 {
     struct Globals* g = globals;
+    if(!g->bottleneck) g->stopStart = naTime();
     g->bottleneck = 1;
     while(g->bottleneck && g->waitCount < g->nThreads - 1) {
+        double t = naTime();
         g->waitCount++;
+        g->safeCount += safe;
         UNLOCK(); naSemDown(g->sem); LOCK();
         g->waitCount--;
+        g->safeCount -= safe;
+        g->stats.waitTotal += naTime() - t;
     }
     if(g->waitCount >= g->nThreads - 1) {
+        double t = naTime();
+        g->stats.stops++;
+        g->stats.ttspTotal += t - g->stopStart;
+        if(t - g->stopStart > g->stats.ttspMax)
+            g->stats.ttspMax = t - g->stopStart;
+        if(g->needCompact) {
+            // Compact only if every thread is safe, otherwise give up
+            // until the next regular collection asks again.  Threads
+            // in the native state are stopped, but in C code that may
+            // hold naRefs.
+            if(safe && g->safeCount == g->waitCount && !g->nNative)
+                g->needGC = 1;
+            else g->needCompact = 0;
+        }
+        naArena_bulk(1);
         freeDead();
-        if(g->needGC) garbageCollect();
+        if(g->needGC) {
+            if(g->snapshot) snapshot(g->snapshot);
+            g->snapshot = 0;
+            garbageCollect();
+        }
+        naArena_bulk(0);
+        t = naTime() - t;
+        g->stats.pauseTotal += t;
+        if(t > g->stats.pauseMax) g->stats.pauseMax = t;
         if(g->waitCount) naSemUp(g->sem, g->waitCount);
         g->bottleneck = 0;
     }
@@ -120,7 +371,34 @@ static void bottleneck()
 
 void naCheckBottleneck()
 {
-    if(globals->bottleneck) { LOCK(); bottleneck(); UNLOCK(); }
+    struct Globals* g = globals;
+    if(g->bottleneck) { naLock(g->lock); bottleneck(0); naUnlock(g->lock); }
+}
+
+// Called from the interpreter's loop back-edge, where a thread holds
+// no heap pointers on the C stack unless it is running underneath a
+// C function: in a subcontext, or in a context that C code like the
+// coroutine, event and thread pool libraries runs and marks unsafe.
+// A pending compaction can only run while all threads are at such a
+// point.
+void naGC_safepoint(struct Context* c)
+{
+    struct Globals* g = c->isolate;
+    quiesce(currec());
+    if(g->nfinal) naGCFinalize();
+    if(g->budgetHit) {
+        struct Context* top = c;
+        while(top->callParent) top = top->callParent;
+        if(top->overBudget) budgeterror(top, c);
+    }
+    if(!g->bottleneck && !g->needCompact) return;
+    naLock(g->lock);
+    if(g->needCompact && !g->bottleneck) {
+        g->stopStart = naTime();
+        g->bottleneck = 1;
+    }
+    if(g->bottleneck) bottleneck(SAFE(c));
+    naUnlock(g->lock);
 }
 
 static void naCode_gcclean(struct naCode* o)
@@ -128,15 +406,51 @@ static void naCode_gcclean(struct naCode* o)
     naFree(o->constants);  o->constants = 0;
 }
 
+// Ghost destructors can be slow (closing files or databases), so
+// rather than run them with every thread stopped the collector queues
+// them for naGCFinalize(), which threads call at their safe points
 static void naGhost_gcclean(struct naGhost* g)
 {
-    if(g->ptr && g->gtype->destroy) g->gtype->destroy(g->ptr);
+    struct Globals* gl = globals;
+    if(g->ptr && g->gtype->destroy) {
+        if(gl->nfinal >= gl->finalsz) {
+            gl->finalsz = gl->finalsz ? 2*gl->finalsz : 32;
+            gl->finalq = naRealloc(gl->finalq,
+                                   gl->finalsz * sizeof(struct GhostFinal));
+        }
+        gl->finalq[gl->nfinal].destroy = g->gtype->destroy;
+        gl->finalq[gl->nfinal++].ptr = g->ptr;
+    }
     g->ptr = 0;
 }
 
-static void freeelem(struct naPool* p, struct naObj* o)
+// The destructors run in the native state when the caller holds the
+// mod lock, so a slow one doesn't hold up other threads' collections.
+// They must not touch the Nasal heap.
+int naGCFinalize()
+{
+    int i, n;
+    struct GhostFinal* q;
+    struct EpochRec* r = currec();
+    int held = r && r->active;
+    LOCK();
+    q = globals->finalq;
+    n = globals->nfinal;
+    globals->finalq = 0;
+    globals->nfinal = globals->finalsz = 0;
+    globals->stats.finalized += n;
+    UNLOCK();
+    if(held) naEnterNative();
+    for(i=0; i<n; i++)
+        q[i].destroy(q[i].ptr);
+    if(held) naLeaveNative();
+    naFree(q);
+    return n;
+}
+
+// Cleans up any intrinsic storage the object might have
+static void cleanelem(struct naPool* p, struct naObj* o)
 {
-    // Clean up any intrinsic storage the object might have...
     switch(p->type) {
     case T_STR:   naStr_gcclean  ((struct naStr*)  o); break;
     case T_VEC:   naVec_gcclean  ((struct naVec*)  o); break;
@@ -144,42 +458,45 @@ static void freeelem(struct naPool* p, struct naObj* o)
     case T_CODE:  naCode_gcclean ((struct naCode*) o); break;
     case T_GHOST: naGhost_gcclean((struct naGhost*)o); break;
     }
-    p->free[p->nfree++] = o;  // ...and add it to the free list
 }
 
+// Adds enough blocks to hold at least need more objects.  The new
+// objects are appended to the current free frame if it ends at the
+// top of the free list (as it does straight after reap()), otherwise
+// they start a new one.
 static void newBlock(struct naPool* p, int need)
 {
-    int i;
-    struct Block* newb;
+    int i, per = (BLOCK_SIZE - BLOCK_HDR) / p->elemsz;
 
     if(need < MIN_BLOCK_SIZE) need = MIN_BLOCK_SIZE;
 
-    newb = naAlloc(sizeof(struct Block));
-    newb->block = naAlloc(need * p->elemsz);
-    newb->size = need;
-    newb->next = p->blocks;
-    p->blocks = newb;
-    naBZero(newb->block, need * p->elemsz);
-    
-    if(need > p->freesz - p->freetop) need = p->freesz - p->freetop;
-    p->nfree = 0;
-    p->free = p->free0 + p->freetop;
-    for(i=0; i < need; i++) {
-        struct naObj* o = (struct naObj*)(newb->block + i*p->elemsz);
-        o->mark = 0;
-        p->free[p->nfree++] = o;
+    if(p->nfree == 0)
+        p->free = p->free0 + p->freetop;
+    for(; need > 0; need -= per) {
+        struct Block* b = naAllocAligned(BLOCK_SIZE, BLOCK_SIZE);
+        naBZero(b, BLOCK_SIZE);
+        b->block = (char*)b + BLOCK_HDR;
+        b->size = per;
+        b->next = p->blocks;
+        p->blocks = b;
+        for(i=0; i < per && p->freetop < p->freesz; i++, p->freetop++)
+            p->free[p->nfree++] = OBJAT(p, b, i);
     }
-    p->freetop += need;
 }
 
 void naGC_init(struct naPool* p, int type)
 {
+    int i, per;
     p->type = type;
     p->elemsz = naTypeSize(type);
     p->blocks = 0;
 
+    per = (BLOCK_SIZE - BLOCK_HDR) / p->elemsz;
+    for(i=0; i<per; i++)
+        SETBIT(starts[type], i * p->elemsz / GRAIN);
+
     p->free0 = p->free = 0;
-    p->nfree = p->freesz = p->freetop = 0;
+    p->nfree = p->freesz = p->freetop = p->peak = 0;
     reap(p);
 }
 
@@ -193,24 +510,270 @@ static int poolsize(struct naPool* p)
 
 struct naObj** naGC_get(struct naPool* p, int n, int* nout)
 {
+    struct Globals* g = globals;
     struct naObj** result;
+    quiesce(currec());
     naCheckBottleneck();
-    LOCK();
-    while(globals->allocCount < 0 || (p->nfree == 0 && p->freetop >= p->freesz)) {
-        globals->needGC = 1;
-        bottleneck();
+    naLock(g->lock);
+    while(g->allocCount < 0 || (p->nfree == 0 && p->freetop >= p->freesz)) {
+        g->needGC = 1;
+        bottleneck(0);
     }
     if(p->nfree == 0)
         newBlock(p, poolsize(p)/8);
     n = p->nfree < n ? p->nfree : n;
     *nout = n;
     p->nfree -= n;
-    globals->allocCount -= n;
+    g->allocCount -= n;
     result = (struct naObj**)(p->free + p->nfree);
-    UNLOCK();
+    naUnlock(g->lock);
     return result;
 }
 
+// Hands the objects still cached in a context back to the pools.
+// That is only possible if the context's run is still the most recent
+// one taken from the pool's free frame (the common case for short
+// subcontext calls); otherwise the objects are simply dropped.  They
+// are unmarked, so the next collection puts them back on the free
+// list anyway.  Must be called with the big lock!
+void naGC_release(struct Context* c)
+{
+    int i;
+    for(i=0; i<NUM_NASAL_TYPES; i++) {
+        struct naPool* p = &globals->pools[i];
+        if(c->nfree[i] && c->free[i] == (struct naObj**)(p->free + p->nfree)) {
+            p->nfree += c->nfree[i];
+            globals->allocCount += c->nfree[i];
+        }
+        c->nfree[i] = 0;
+    }
+}
+
+// Records the objects handed out of the free list since the last
+// collection in the used bitmaps.  Those and the previous survivors
+// are the only objects the sweep may need to clean up.  Handed out
+// entries are everything below the current free frame, plus the
+// part of the frame already taken from its top.
+static void noteallocs(struct naPool* p)
+{
+    struct naObj** e = (struct naObj**)p->free0;
+    struct naObj** top = e + p->freetop;
+    for(; e < top; e++) {
+        struct Block* b;
+        if(e == (struct naObj**)p->free && p->nfree) {
+            e += p->nfree - 1;
+            continue;
+        }
+        b = BLOCKOF(*e);
+        SETBIT(b->used, BITOF(b, *e));
+    }
+}
+
+// The bytes taken up by an object, including the storage it owns
+static long objbytes(struct naObj* o)
+{
+    long bytes = globals->pools[o->type].elemsz;
+    switch(o->type) {
+    case T_STR:
+        if(((struct naStr*)o)->emblen == -1 && ((struct naStr*)o)->data.ref.ptr)
+            bytes += naArena_size(((struct naStr*)o)->data.ref.ptr);
+        break;
+    case T_VEC:  bytes += naArena_size(((struct naVec*)o)->rec);  break;
+    case T_HASH: bytes += naArena_size(((struct naHash*)o)->rec); break;
+    case T_CODE: {
+        struct naCode* c = (struct naCode*)o;
+        if(c->constants)
+            bytes += (char*)(LINEIPS(c)+c->nLines) - (char*)c->constants;
+        break; }
+    case T_GHOST: {
+        struct naGhost* g = (struct naGhost*)o;
+        if(g->gtype->bytes && g->ptr) bytes += g->gtype->bytes(g->ptr);
+        break; }
+    }
+    return bytes;
+}
+
+// The context running on this thread, and the top level context whose
+// memory budget pays for what the thread allocates, if it has one
+static NA_THREAD_LOCAL struct Context* running;
+static NA_THREAD_LOCAL struct Context* payer;
+
+// Makes c (or none) the context running on this thread, returning the
+// previous one.  naCall() and friends call this as they start and end.
+struct Context* naGC_run(struct Context* c)
+{
+    struct Context *old = running, *top = c;
+    while(top && top->callParent) top = top->callParent;
+    running = c;
+    payer = top && (top->maxObjects || top->maxBytes) ? top : 0;
+    return old;
+}
+
+static int fits(struct Context* c, int objects, long bytes)
+{
+    long maxo = c->grace ? c->graceObjects : c->maxObjects;
+    long maxb = c->grace ? c->graceBytes : c->maxBytes;
+    return !(maxo && c->usedObjects + objects > maxo)
+        && !(maxb && c->usedBytes + bytes > maxb);
+}
+
+// After a budget error the context gets an eighth more than it was
+// using, so that it can handle the error: the failed call's stack
+// stays reachable from its subcontext for a while, and the error may
+// come an instruction after the allocation that went over.  Further
+// errors don't extend it.  See markbudgets().
+static void budgeterror(struct Context* c, struct Context* ctx)
+{
+    c->overBudget = 0;
+    if(!c->grace) {
+        c->grace = 1;
+        c->graceObjects = c->maxObjects ? c->maxObjects/8
+            + (c->usedObjects > c->maxObjects ? c->usedObjects : c->maxObjects) : 0;
+        c->graceBytes = c->maxBytes ? c->maxBytes/8
+            + (c->usedBytes > c->maxBytes ? c->usedBytes : c->maxBytes) : 0;
+    }
+    naRuntimeError(ctx, "memory budget exceeded");
+}
+
+// Forces a collection, which measures what c really still reaches:
+// between collections usage only grows (storage freed is not
+// subtracted).  Returns whether the allocation then fits.
+static int recount(struct Context* c, int objects, long bytes)
+{
+    LOCK();
+    globals->needGC = 1;
+    while(globals->needGC)
+        bottleneck(0);
+    UNLOCK();
+    return fits(c, objects, bytes);
+}
+
+static void overbudget(struct Context* c)
+{
+    c->overBudget = 1;
+    globals->budgetHit = 1;
+}
+
+// Charges an allocation, before it is made, to the budget of the
+// running context.  One that doesn't fit forces a collection, and if
+// it still doesn't, goes ahead but flags the context so that the
+// error is raised at its next safe point: allocations happen all
+// over C code that can't be longjmp'd out of.  Once flagged, no more
+// collections are forced until then.
+void naGC_spend(int objects, long bytes)
+{
+    struct Context* c = payer;
+    if(!c) return;
+    if(!c->overBudget && !fits(c, objects, bytes)
+       && !recount(c, objects, bytes))
+        overbudget(c);
+    c->usedObjects += objects;
+    c->usedBytes += bytes;
+}
+
+// As naGC_spend(), for callers holding a lock, who mustn't stop for a
+// collection
+void naGC_count(long bytes)
+{
+    struct Context* c = payer;
+    if(!c) return;
+    c->usedBytes += bytes;
+    if(!fits(c, 0, 0)) overbudget(c);
+}
+
+// For C functions about to make one large allocation sized by a
+// script, like setsize(): raises the budget error in ctx right away
+// if it can't fit, rather than making it and failing afterwards.
+// Call it before holding anything that an error would leak.  The
+// allocation itself is still charged by naGC_spend().
+void naGC_reserve(naContext ctx, long bytes)
+{
+    struct Context* c = payer;
+    if(!c || fits(c, 0, bytes) || recount(c, 0, bytes)) return;
+    budgeterror(c, ctx);
+}
+
+// Set while marking from a budgeted context, to count what it reaches
+static NA_THREAD_LOCAL int counting;
+static NA_THREAD_LOCAL long markObjs, markBytes;
+
+// Marks from the roots of each context with a memory budget (and its
+// subcontexts) before anything else, so that what they reach is
+// counted against them, and flags the ones over their limits.  An
+// object reachable from several budgeted contexts is counted only
+// against the first of them in allContexts to reach it.
+static void markbudgets()
+{
+    struct Globals* g = globals;
+    int over = 0;
+    struct Context *c, *s;
+    for(c = g->allContexts; c; c = c->nextAll) {
+        if(c->callParent || !(c->maxObjects || c->maxBytes)) continue;
+        markObjs = markBytes = 0;
+        counting = 1;
+        for(s = c; s; s = s->callChild)
+            ctxroots(s, mark, 0);
+        counting = 0;
+        c->usedObjects = markObjs;
+        c->usedBytes = markBytes;
+        c->overBudget = !fits(c, 0, 0);
+        if(c->grace) {
+            c->grace = 0;
+            c->grace = !fits(c, 0, 0); // still using the extra
+        }
+        over |= c->overBudget;
+    }
+    g->budgetHit = over;
+}
+
+// Weak hashes reached by the current collection
+static NA_THREAD_LOCAL struct naHash** weak;
+static NA_THREAD_LOCAL int nweak, weaksz;
+
+static int marked(naRef r)
+{
+    struct Block* b;
+    if(!IS_OBJ(r)) return 1;
+    b = BLOCKOF(PTR(r).obj);
+    return TESTBIT(b->mark, BITOF(b, PTR(r).obj)) != 0;
+}
+
+static void addweak(struct naHash* h)
+{
+    if(nweak >= weaksz) {
+        weaksz = weaksz ? 2*weaksz : 16;
+        weak = naRealloc(weak, weaksz * sizeof(struct naHash*));
+    }
+    weak[nweak++] = h;
+}
+
+static NA_THREAD_LOCAL int weakMore;
+static void markephemeron(naRef key, naRef val)
+{
+    if(marked(key) && !marked(val)) {
+        mark(val);
+        weakMore = 1;
+    }
+}
+
+// Weak hash entries are ephemerons: a value is reachable through one
+// only if its key is reachable some other way.  Marking values can
+// reach more keys (and more weak hashes), so this repeats until
+// nothing changes, then drops the entries whose keys are dead.  Must
+// run before any objects move.
+static void markweak()
+{
+    int i;
+    do {
+        weakMore = 0;
+        for(i=0; i<nweak; i++)
+            naiGCHashPairs(weak[i], markephemeron);
+    } while(weakMore);
+    for(i=0; i<nweak; i++)
+        naiGCHashSweep(weak[i], marked);
+    nweak = 0;
+}
+
 static void markvec(naRef r)
 {
     int i;
@@ -225,17 +788,28 @@ static void markvec(naRef r)
 static void mark(naRef r)
 {
     int i;
+    unsigned int bit;
+    struct Block* b;
 
     if(IS_NUM(r) || IS_NIL(r))
         return;
 
-    if(PTR(r).obj->mark == 1)
+    b = BLOCKOF(PTR(r).obj);
+    bit = BITOF(b, PTR(r).obj);
+    if(TESTBIT(b->mark, bit))
         return;
 
-    PTR(r).obj->mark = 1;
+    SETBIT(b->mark, bit);
+    if(counting) {
+        markObjs++;
+        markBytes += objbytes(PTR(r).obj);
+    }
     switch(PTR(r).obj->type) {
     case T_VEC: markvec(r); break;
-    case T_HASH: naiGCMarkHash(r); break;
+    case T_HASH:
+        if(PTR(r).hash->weak) addweak(PTR(r).hash);
+        else naiGCMarkHash(r);
+        break;
     case T_CODE:
         mark(PTR(r).code->srcFile);
         for(i=0; i<PTR(r).code->nConstants; i++)
@@ -246,6 +820,10 @@ static void mark(naRef r)
         mark(PTR(r).func->namespace);
         mark(PTR(r).func->next);
         break;
+    case T_GHOST:
+        if(PTR(r).ghost->gtype->refs && PTR(r).ghost->ptr)
+            PTR(r).ghost->gtype->refs(PTR(r).ghost->ptr, markslot);
+        break;
     }
 }
 
@@ -254,12 +832,135 @@ void naiGCMark(naRef r)
     mark(r);
 }
 
-// Collects all the unreachable objects into a free list, and
-// allocates more space if needed.
+static int countlive(struct Block* b)
+{
+    int i, n = 0;
+    for(i=0; i<MAPWORDS; i++)
+        n += popcount(b->mark[i]);
+    return n;
+}
+
+// Finds the next dead slot, in a block that is staying, to move an
+// object into.
+static struct naObj* nextslot(struct naPool* p, struct Block** b, int* i)
+{
+    while(1) {
+        struct naObj* o;
+        if((*b)->release || *i >= (*b)->size) {
+            *b = (*b)->next;
+            *i = 0;
+            continue;
+        }
+        o = OBJAT(p, *b, (*i)++);
+        if(!TESTBIT((*b)->mark, BITOF(*b, o))) return o;
+    }
+}
+
+// Moves the live objects out of the sparsest blocks of a pool into
+// dead slots in the other blocks, leaving forwarding pointers behind.
+// Blocks holding pinned objects stay where they are.  Runs after
+// marking and before the sweep.
+static void evacuate(struct naPool* p)
+{
+    struct Globals* g = globals;
+    struct Block *b, *dst = p->blocks;
+    int i, di = 0, room = 0, moving = 0;
+    if(!MOVABLE(p->type)) return;
+    for(b = p->blocks; b; b = b->next) {
+        b->live = countlive(b);
+        room += b->size - b->live;
+    }
+    for(b = p->blocks; b; b = b->next) {
+        int space = b->size - b->live;
+        if(b->pinned || b->live == 0) continue;
+        if(b->live >= b->size * g->tuning.compact) continue;
+        if(moving + b->live > room - space) continue;
+        b->release = 1;
+        room -= space;
+        moving += b->live;
+    }
+    for(b = p->blocks; b; b = b->next) {
+        if(!b->release) continue;
+        for(i=0; i<MAPWORDS; i++) {
+            unsigned int m;
+            for(m = b->mark[i]; m; m &= m - 1) {
+                struct naObj *o = BITOBJ(p, b, i*32 + lowbit(m));
+                struct naObj *d = nextslot(p, &dst, &di);
+                unsigned int bit = BITOF(dst, d);
+                if(TESTBIT(dst->used, bit)) cleanelem(p, d);
+                memcpy(d, o, p->elemsz);
+                SETBIT(dst->mark, bit);
+                FWD(o) = d;
+            }
+        }
+    }
+    g->stats.moved += moving;
+}
+
+static void fixref(naRef* r)
+{
+    struct Block* b;
+    if(!IS_OBJ(*r)) return;
+    b = BLOCKOF(PTR(*r).obj);
+    if(b->release && TESTBIT(b->mark, BITOF(b, PTR(*r).obj)))
+        SETPTR(*r, FWD(PTR(*r).obj));
+}
+
+// Points the references held by live objects at the new copies of
+// evacuated ones.  The roots need no fixing, they are all pinned.
+static void fixrefs(struct naPool* p)
+{
+    int i, j;
+    unsigned int m;
+    struct Block* b;
+    if(p->type != T_VEC && p->type != T_HASH && p->type != T_CODE
+       && p->type != T_FUNC && p->type != T_GHOST)
+        return;
+    for(b = p->blocks; b; b = b->next) {
+        if(b->release) continue;
+        for(i=0; i<MAPWORDS; i++) for(m = b->mark[i]; m; m &= m - 1) {
+            struct naObj* o = BITOBJ(p, b, i*32 + lowbit(m));
+            switch(p->type) {
+            case T_VEC: {
+                struct VecRec* vr = ((struct naVec*)o)->rec;
+                for(j=0; vr && j<vr->size; j++)
+                    fixref(&vr->array[j]);
+                break;
+            }
+            case T_HASH:
+                naiGCHashRefs((struct naHash*)o, fixref);
+                break;
+            case T_CODE: {
+                struct naCode* c = (struct naCode*)o;
+                fixref(&c->srcFile);
+                for(j=0; c->constants && j<c->nConstants; j++)
+                    fixref(&c->constants[j]);
+                break;
+            }
+            case T_FUNC:
+                fixref(&((struct naFunc*)o)->code);
+                fixref(&((struct naFunc*)o)->namespace);
+                fixref(&((struct naFunc*)o)->next);
+                break;
+            case T_GHOST:
+                if(((struct naGhost*)o)->gtype->refs && ((struct naGhost*)o)->ptr)
+                    ((struct naGhost*)o)->gtype->refs(((struct naGhost*)o)->ptr,
+                                                      fixref);
+                break;
+            }
+        }
+    }
+}
+
+// Collects all the unreachable objects into a free list, counting
+// the survivors in each block.  Dead objects that were in use get
+// their storage cleaned up; the rest have been clean since they were
+// last swept.  The objects in blocks being released are cleaned up
+// but not added.
 static void reap(struct naPool* p)
 {
     struct Block* b;
-    int elem, freesz, total = poolsize(p);
+    int i, freesz, total = poolsize(p);
     freesz = total < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : total;
     freesz = (3 * freesz / 2) + (globals->nThreads * OBJ_CACHE_SZ);
     if(p->freesz < freesz) {
@@ -271,48 +972,490 @@ static void reap(struct naPool* p)
     p->nfree = 0;
     p->free = p->free0;
 
-    for(b = p->blocks; b; b = b->next)
-        for(elem=0; elem < b->size; elem++) {
-            struct naObj* o = (struct naObj*)(b->block + elem * p->elemsz);
-            if(o->mark == 0)
-                freeelem(p, o);
-            o->mark = 0;
+    for(b = p->blocks; b; b = b->next) {
+        b->live = 0;
+        for(i=0; i<MAPWORDS; i++) {
+            unsigned int m = b->mark[i], dead = b->used[i] & ~m;
+            unsigned int avail = b->release ? 0 : starts[p->type][i] & ~m;
+            for(; dead; dead &= dead - 1)
+                cleanelem(p, BITOBJ(p, b, i*32 + lowbit(dead)));
+            for(; avail; avail &= avail - 1)
+                p->free[p->nfree++] = BITOBJ(p, b, i*32 + lowbit(avail));
+            if(!b->release) b->live += popcount(m);
+            b->used[i] = m;
+            b->mark[i] = 0;
         }
+    }
 
     p->freetop = p->nfree;
+}
+
+// Runs after the sweep.  Frees the evacuated blocks, and empty ones
+// beyond what is needed to keep room for the next allocation budget
+// plus growFree free objects per live one (so the pool doesn't just
+// grow back), then grows the pool if too little is free.  The amount
+// kept is based on a slowly decaying peak of the live count, so that
+// programs whose heap swings up and down each cycle don't free and
+// reallocate blocks every time.  Returns the number of sparse blocks
+// a compaction could evacuate, and adds the bytes freed to *freed.
+static int trim(struct naPool* p, long* freed)
+{
+    struct Globals* g = globals;
+    naGCTuning* t = &g->tuning;
+    struct Block *b, **bp;
+    int i, j, keep, nrelease = 0, sparse = 0, used = 0, total = 0;
+
+    for(b = p->blocks; b; b = b->next)
+        if(!b->release) { used += b->live; total += b->size; }
+    p->peak = used > p->peak ? used : p->peak - p->peak/16;
+    keep = (int)(p->peak * (1 + t->growFree));
+    if(t->allocRatio < 1 && keep < p->peak / (1 - t->allocRatio))
+        keep = (int)(p->peak / (1 - t->allocRatio));
+
+    for(b = p->blocks; b; b = b->next) {
+        if(b->release) {
+            nrelease++;
+        } else if(b->live == 0 && total - b->size >= keep) {
+            b->release = 1;
+            total -= b->size;
+            nrelease++;
+        } else if(MOVABLE(p->type) && b->live < b->size * t->compact) {
+            sparse++;
+        }
+    }
+
+    if(nrelease) {
+        for(i=j=0; i<p->nfree; i++)
+            if(!BLOCKOF(p->free[i])->release)
+                p->free[j++] = p->free[i];
+        p->nfree = p->freetop = j;
+        for(bp = &p->blocks; (b = *bp); ) {
+            if(!b->release) { bp = &b->next; continue; }
+            *bp = b->next;
+            naFreeAligned(b);
+            *freed += BLOCK_SIZE;
+        }
+    }
 
     // allocs of this type until the next collection
-    globals->allocCount += total/2;
+    g->allocCount += (int)(total * t->allocRatio);
     
-    // Allocate more if necessary (try to keep 25-50% of the objects
-    // available)
-    if(p->nfree < total/4) {
-        int used = total - p->nfree;
-        int avail = total - used;
-        int need = used/2 - avail;
+    // Allocate more if necessary (by default, try to keep 25-50% of
+    // the objects available)
+    if(p->nfree < total * t->minFree) {
+        int need = (int)(used * t->growFree) - p->nfree;
         if(need > 0)
             newBlock(p, need);
     }
+    g->stats.live[p->type] = used;
+    g->stats.free[p->type] = poolsize(p) - used;
+    return sparse;
 }
 
-// Does the swap, returning the old value
-static void* doswap(void** target, void* val)
+// Keeps a symbol returned by naInternSymbol() alive, even if it is
+// referenced only from the C stack (the symbol table itself holds it
+// weakly), to give the caller time to store it somewhere visible.
+// With a context running on the thread that is just a temp, which
+// lasts until the context's next instruction and needs no lock; code
+// calling in from outside gets it held through the next collection.
+void naGC_holdsym(naRef sym)
 {
-    void* old = *target;
-    *target = val;
-    return old;
+    struct Globals* g = globals;
+    if(running) { naTempSave(running, sym); return; }
+    naLock(g->lock);
+    if(g->nHeldSyms >= g->heldSymsSz) {
+        g->heldSymsSz = g->heldSymsSz ? 2*g->heldSymsSz : 64;
+        g->heldSyms = naRealloc(g->heldSyms,
+                                      g->heldSymsSz * sizeof(naRef));
+    }
+    g->heldSyms[g->nHeldSyms++] = sym;
+    naUnlock(g->lock);
 }
 
-// Atomically replaces target with a new pointer, and adds the old one
-// to the list of blocks to free the next time something holds the
-// giant lock.
+// Lets go of the held symbols that were already held through the
+// previous collection
+static void agesyms()
+{
+    struct Globals* g = globals;
+    int n = g->nHeldSyms - g->heldSymsOld;
+    memmove(g->heldSyms, g->heldSyms + g->heldSymsOld, n * sizeof(naRef));
+    g->nHeldSyms = g->heldSymsOld = n;
+}
+
+// Deferred freeing.  Vector and hash storage is read without locks,
+// so a replaced block can only be freed once no thread can still be
+// looking at it.  Rather than stopping the world for that, each
+// thread holding the mod lock announces the global epoch it has seen
+// at its quiescent points, where it holds no such pointers.  Once
+// every active thread has seen the current epoch it can advance, and
+// a block retired in epoch e is safe to free when the epoch reaches
+// e+2.  Each thread keeps its own lists of retired blocks, so none of
+// this needs the big lock.  Blocks replaced by a thread not holding
+// the mod lock, or by one whose lists have grown too long because
+// some thread isn't reaching quiescent points, go on the dead block
+// list freed at the next bottleneck.  A bottleneck frees everything.
+static void freebucket(struct EpochRec* r, int i)
+{
+    int j;
+    for(j=0; j<r->limbo[i].n; j++)
+        naArena_free(r->limbo[i].blocks[j]);
+    r->nlimbo -= r->limbo[i].n;
+    r->limbo[i].n = 0;
+}
+
+static void threadexit(void* rec)
+{
+    ((struct EpochRec*)rec)->dead = 1;
+}
+
+// Returns the calling thread's record, creating it if needed.  Must
+// be called with the big lock!
+static struct EpochRec* threadrec()
+{
+    struct EpochRec* r;
+    if(!globals->epochKey) globals->epochKey = naNewTls(threadexit);
+    if((r = naTlsGet(globals->epochKey))) return r;
+    r = naAlloc(sizeof(struct EpochRec));
+    naBZero(r, sizeof(struct EpochRec));
+    r->next = globals->epochRecs;
+    naMemBarrier();
+    globals->epochRecs = r;
+    naTlsSet(globals->epochKey, r);
+    return r;
+}
+
+static struct EpochRec* currec()
+{
+    struct Globals* g = globals;
+    return g->epochKey ? naTlsGet(g->epochKey) : 0;
+}
+
+// Advances the epoch if every active thread has seen it, otherwise
+// asks them to check in (see OP_JMPLOOP)
+static void tryadvance()
+{
+    struct Globals* g = globals;
+    struct EpochRec* r;
+    unsigned int e = g->epoch;
+    for(r = g->epochRecs; r; r = r->next)
+        if(r->active && r->epoch != e) {
+            g->needEpoch = 1;
+            return;
+        }
+    if(naAtomicCAS((volatile int*)&g->epoch, e, e+1))
+        g->needEpoch = 0;
+}
+
+// Announces a quiescent point for the calling thread, and frees what
+// it retired long enough ago
+static void quiesce(struct EpochRec* r)
+{
+    struct Globals* g = globals;
+    int i;
+    unsigned int e;
+    if(!r || !r->active) return;
+    if(g->needEpoch) tryadvance();
+    e = g->epoch;
+    if(r->epoch == e) return;
+    r->epoch = e;
+    naMemBarrier();
+    for(i=0; i<EPOCH_BUCKETS; i++)
+        if(r->limbo[i].n && e - r->limbo[i].epoch >= 2)
+            freebucket(r, i);
+}
+
+static void retire(struct EpochRec* r, void* old)
+{
+    unsigned int e = globals->epoch;
+    int i = e % EPOCH_BUCKETS;
+    if(r->limbo[i].epoch != e) {
+        freebucket(r, i); // from three or more epochs ago
+        r->limbo[i].epoch = e;
+    }
+    if(r->limbo[i].n >= r->limbo[i].sz) {
+        r->limbo[i].sz = r->limbo[i].sz ? 2*r->limbo[i].sz : 64;
+        r->limbo[i].blocks = naRealloc(r->limbo[i].blocks,
+                                       r->limbo[i].sz * sizeof(void*));
+    }
+    r->limbo[i].blocks[r->limbo[i].n++] = old;
+    r->nlimbo++;
+    if(++r->retires >= EPOCH_ADVANCE) {
+        r->retires = 0;
+        tryadvance();
+    }
+}
+
+// Frees all retired blocks, and the records of exited threads.  Must
+// be called with the world stopped.
+static void freeRetired()
+{
+    int i;
+    struct EpochRec *r, **rp;
+    for(rp = &globals->epochRecs; (r = *rp); ) {
+        for(i=0; i<EPOCH_BUCKETS; i++)
+            freebucket(r, i);
+        if(!r->dead || r->active) { rp = &r->next; continue; }
+        *rp = r->next;
+        for(i=0; i<EPOCH_BUCKETS; i++)
+            naFree(r->limbo[i].blocks);
+        naFree(r);
+    }
+}
+
+// Atomically replaces target with a new pointer, and retires the old
+// one to be freed once no thread can be using it (see above).  The
+// old block must have come from naArena_alloc().
 void naGC_swapfree(void** target, void* val)
 {
-    void* old;
+    struct Globals* g = globals;
+    struct EpochRec* r = currec();
+    void* old = naAtomicSwap(target, val);
+    if(r && r->active && r->nlimbo < g->deadsz) {
+        retire(r, old);
+        return;
+    }
+    naLock(g->lock);
+    while(g->ndead >= g->deadsz)
+        bottleneck(0);
+    g->deadBlocks[g->ndead++] = old;
+    naUnlock(g->lock);
+}
+
+// Forces a full collection, compacting if asked to and it is safe.
+// Must be called with the mod lock held, from a C function called
+// directly by the interpreter (which holds no raw heap pointers).
+void naGC_collect(struct Context* c, int compact)
+{
+    LOCK();
+    globals->needGC = 1;
+    if(compact) globals->needCompact = 1;
+    while(globals->needGC)
+        bottleneck(SAFE(c));
+    UNLOCK();
+}
+
+// Heap snapshots: a text file describing every reachable object and
+// the references between them, in the format read by gc.analyze()
+// (lib/gc.nas).  One record per line:
+//
+//   R <kind> <id>                      a root reference
+//   O <id> <type> <bytes> [<text>]     an object and the memory it owns
+//   E <from> <to> <label>              a reference between objects
+//
+// Ids are object addresses.  The label of a hash entry is its key,
+// and text (a string's contents, or the source file of code) is cut
+// short with spaces and control characters replaced.  Visited objects
+// are tracked with the mark bits, which are cleared again afterwards.
+#define SNAP_TEXT 48
+
+static NA_THREAD_LOCAL FILE* snapf;
+static NA_THREAD_LOCAL naRef snapFrom;
+
+static const char* snapTypes[NUM_NASAL_TYPES] =
+    { "string", "vector", "hash", "code", "func", "ccode", "ghost" };
+
+static void snaptext(naRef s)
+{
+    int i, len = naStr_len(s);
+    unsigned char* d = (unsigned char*)naStr_data(s);
+    if(len > SNAP_TEXT) len = SNAP_TEXT;
+    for(i=0; i<len; i++)
+        fputc(d[i] > ' ' && d[i] < 127 ? d[i] : '?', snapf);
+    if(len == 0) fputs("\"\"", snapf);
+}
+
+static void snapedge(naRef to, const char* label, naRef key)
+{
+    if(!IS_OBJ(to)) return;
+    fprintf(snapf, "E %p %p ", (void*)PTR(snapFrom).obj, (void*)PTR(to).obj);
+    if(IS_STR(key)) snaptext(key);
+    else if(IS_NUM(key)) fprintf(snapf, "[%.17g]", key.num);
+    else fputs(label, snapf);
+    fputc('\n', snapf);
+}
+
+static void snapentry(naRef key, naRef val)
+{
+    snapedge(key, "(key)", naNil());
+    snapedge(val, 0, key);
+}
+
+static void snapobj(naRef r);
+static void snapvisit(naRef key, naRef val) { snapobj(key); snapobj(val); }
+static void snapghostedge(naRef* r) { snapedge(*r, "(ghost)", naNil()); }
+static void snapghostvisit(naRef* r) { snapobj(*r); }
+
+// Writes the object's record and edges, then visits what it refers to
+static void snapobj(naRef r)
+{
+    int i;
+    unsigned int bit;
+    struct Block* b;
+    struct naObj* o;
+
+    if(!IS_OBJ(r)) return;
+    o = PTR(r).obj;
+    b = BLOCKOF(o);
+    bit = BITOF(b, o);
+    if(TESTBIT(b->mark, bit)) return;
+    SETBIT(b->mark, bit);
+
+    fprintf(snapf, "O %p %s %ld", (void*)o, snapTypes[o->type], objbytes(o));
+    if(o->type == T_STR) {
+        fputc(' ', snapf);
+        snaptext(r);
+    } else if(o->type == T_CODE && IS_STR(((struct naCode*)o)->srcFile)) {
+        fputc(' ', snapf);
+        snaptext(((struct naCode*)o)->srcFile);
+    }
+    fputc('\n', snapf);
+
+    snapFrom = r;
+    switch(o->type) {
+    case T_VEC: {
+        struct VecRec* vr = ((struct naVec*)o)->rec;
+        for(i=0; vr && i<vr->size; i++)
+            snapedge(vr->array[i], 0, naNum(i));
+        for(i=0; vr && i<vr->size; i++)
+            snapobj(vr->array[i]);
+        break; }
+    case T_HASH:
+        naiGCHashPairs((struct naHash*)o, snapentry);
+        naiGCHashPairs((struct naHash*)o, snapvisit);
+        break;
+    case T_CODE: {
+        struct naCode* c = (struct naCode*)o;
+        snapedge(c->srcFile, "(source)", naNil());
+        for(i=0; i<c->nConstants; i++)
+            snapedge(c->constants[i], "(constant)", naNil());
+        snapobj(c->srcFile);
+        for(i=0; i<c->nConstants; i++)
+            snapobj(c->constants[i]);
+        break; }
+    case T_FUNC: {
+        struct naFunc* f = (struct naFunc*)o;
+        snapedge(f->code, "(code)", naNil());
+        snapedge(f->namespace, "(namespace)", naNil());
+        snapedge(f->next, "(closure)", naNil());
+        snapobj(f->code);
+        snapobj(f->namespace);
+        snapobj(f->next);
+        break; }
+    case T_GHOST: {
+        struct naGhost* g = (struct naGhost*)o;
+        if(g->gtype->refs && g->ptr) {
+            g->gtype->refs(g->ptr, snapghostedge);
+            g->gtype->refs(g->ptr, snapghostvisit);
+        }
+        break; }
+    }
+}
+
+static NA_THREAD_LOCAL const char* snapKind;
+static void snapkind(const char* kind) { snapKind = kind; }
+
+static void snaproot(naRef r)
+{
+    if(IS_OBJ(r))
+        fprintf(snapf, "R %s %p\n", snapKind, (void*)PTR(r).obj);
+}
+
+// Must be called with the big lock!
+static void snapshot(FILE* f)
+{
+    int i;
+    struct Block* b;
+    snapf = f;
+    fprintf(f, "nasal-heap 1\n");
+    roots(snaproot, snapkind);
+    roots(snapobj, 0);
+    for(i=0; i<NUM_NASAL_TYPES; i++)
+        for(b = globals->pools[i].blocks; b; b = b->next)
+            memset(b->mark, 0, sizeof(b->mark));
+}
+
+int naGCSnapshot(const char* file)
+{
+    int ok;
+    FILE* f = fopen(file, "w");
+    if(!f) return 0;
+    LOCK();
+    globals->snapshot = f;
+    globals->needGC = 1;
+    while(globals->needGC)
+        bottleneck(0);
+    UNLOCK();
+    ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+int naGCSave(naRef r)
+{
+    int key;
+    struct Globals* g = globals;
+    LOCK();
+    if(g->cRootsFree) {
+        key = g->cRootsFree - 1;
+        g->cRootsFree = (int)g->cRoots[key].num;
+    } else {
+        if(g->nCRoots >= g->cRootsSz) {
+            g->cRootsSz = g->cRootsSz ? 2*g->cRootsSz : 64;
+            g->cRoots = naRealloc(g->cRoots, g->cRootsSz * sizeof(naRef));
+        }
+        key = g->nCRoots++;
+    }
+    g->cRoots[key] = r;
+    UNLOCK();
+    return key;
+}
+
+void naGCRelease(int key)
+{
+    LOCK();
+    globals->cRoots[key] = naNum(globals->cRootsFree);
+    globals->cRootsFree = key + 1;
+    UNLOCK();
+}
+
+void naSetBudget(naContext c, long objects, long bytes)
+{
+    while(c->callParent) c = c->callParent;
+    LOCK();
+    c->maxObjects = objects;
+    c->maxBytes = bytes;
+    if(!objects && !bytes) c->overBudget = 0;
+    c->grace = 0;
+    UNLOCK();
+    if(running) naGC_run(running); // it may be paying now, or no longer
+}
+
+void naGetBudget(naContext c, long* objects, long* bytes)
+{
+    while(c->callParent) c = c->callParent;
+    LOCK();
+    *objects = c->usedObjects;
+    *bytes = c->usedBytes;
+    UNLOCK();
+}
+
+void naGCStats(naGCInfo* out)
+{
+    LOCK();
+    *out = globals->stats;
+    UNLOCK();
+    naArena_stats(&out->arenaUsed, &out->arenaSize);
+}
+
+void naGCGetTuning(naGCTuning* out)
+{
+    LOCK();
+    *out = globals->tuning;
+    UNLOCK();
+}
+
+void naGCSetTuning(naGCTuning* t)
+{
     LOCK();
-    old = doswap(target, val);
-    while(globals->ndead >= globals->deadsz)
-        bottleneck();
-    globals->deadBlocks[globals->ndead++] = old;
+    globals->tuning = *t;
     UNLOCK();
 }
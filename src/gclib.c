@@ -0,0 +1,152 @@
+#include "nasal.h"
+#include "data.h"
+#include "code.h"
+
+// Pool names, in the order of the naGCInfo per-type arrays
+static const char* typeNames[NA_GC_NTYPES] =
+    { "string", "vector", "hash", "code", "func", "ccode", "ghost" };
+
+static void setnum(naContext c, naRef h, char* key, double val)
+{
+    naAddSym(c, h, key, naNum(val));
+}
+
+static naRef f_stats(naContext c, naRef me, int argc, naRef* args)
+{
+    int i;
+    naGCInfo s;
+    naRef result = naNewHash(c), live = naNewHash(c), free = naNewHash(c);
+    naGCStats(&s);
+    setnum(c, result, "collections", s.collections);
+    setnum(c, result, "pausetotal", s.pauseTotal);
+    setnum(c, result, "pausemax", s.pauseMax);
+    setnum(c, result, "waittotal", s.waitTotal);
+    setnum(c, result, "stops", s.stops);
+    setnum(c, result, "ttsptotal", s.ttspTotal);
+    setnum(c, result, "ttspmax", s.ttspMax);
+    setnum(c, result, "arenaused", s.arenaUsed);
+    setnum(c, result, "arenasize", s.arenaSize);
+    setnum(c, result, "released", s.released);
+    setnum(c, result, "compactions", s.compactions);
+    setnum(c, result, "moved", s.moved);
+    setnum(c, result, "finalized", s.finalized);
+    for(i=0; i<NA_GC_NTYPES; i++) {
+        setnum(c, live, (char*)typeNames[i], s.live[i]);
+        setnum(c, free, (char*)typeNames[i], s.free[i]);
+    }
+    naAddSym(c, result, "live", live);
+    naAddSym(c, result, "free", free);
+    return result;
+}
+
+static int gettune(naContext c, naRef h, char* key, double* out)
+{
+    naRef v = naHash_cget(h, key);
+    if(naIsNil(v)) return 0;
+    v = naNumValue(v);
+    if(naIsNil(v) || v.num < 0)
+        naRuntimeError(c, "gc.tune: bad value for %s", key);
+    *out = v.num;
+    return 1;
+}
+
+static naRef f_tune(naContext c, naRef me, int argc, naRef* args)
+{
+    naGCTuning t;
+    naRef result;
+    naGCGetTuning(&t);
+    if(argc > 0) {
+        if(!naIsHash(args[0])) naRuntimeError(c, "gc.tune: arg not a hash");
+        gettune(c, args[0], "minfree", &t.minFree);
+        gettune(c, args[0], "growfree", &t.growFree);
+        gettune(c, args[0], "allocratio", &t.allocRatio);
+        gettune(c, args[0], "compact", &t.compact);
+        if(t.minFree >= 1 || t.allocRatio == 0 || t.compact > 1)
+            naRuntimeError(c, "gc.tune: value out of range");
+        naGCSetTuning(&t);
+    }
+    result = naNewHash(c);
+    setnum(c, result, "minfree", t.minFree);
+    setnum(c, result, "growfree", t.growFree);
+    setnum(c, result, "allocratio", t.allocRatio);
+    setnum(c, result, "compact", t.compact);
+    return result;
+}
+
+static naRef f_collect(naContext c, naRef me, int argc, naRef* args)
+{
+    naGC_collect(c, argc > 0 && naTrue(args[0]));
+    return naNil();
+}
+
+static naRef f_snapshot(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef file = argc > 0 ? naStringValue(c, args[0]) : naNil();
+    if(!naIsString(file)) naRuntimeError(c, "gc.snapshot: bad filename");
+    if(!naGCSnapshot(naStr_data(file)))
+        naRuntimeError(c, "gc.snapshot: cannot write %s", naStr_data(file));
+    return naNil();
+}
+
+static naRef f_budget(naContext c, naRef me, int argc, naRef* args)
+{
+    long objs, bytes;
+    naRef result;
+    if(argc > 0) {
+        naRef o = naNumValue(args[0]);
+        naRef b = argc > 1 ? naNumValue(args[1]) : naNum(0);
+        if(naIsNil(o) || naIsNil(b) || o.num < 0 || b.num < 0)
+            naRuntimeError(c, "gc.budget: bad limit");
+        naSetBudget(c, (long)o.num, (long)b.num);
+    }
+    naGetBudget(c, &objs, &bytes);
+    result = naNewHash(c);
+    setnum(c, result, "objects", objs);
+    setnum(c, result, "bytes", bytes);
+    return result;
+}
+
+static naRef f_hashstats(naContext c, naRef me, int argc, naRef* args)
+{
+    int cells, maxprobes, maxbucket;
+    double mean;
+    naRef result;
+    if(argc < 1 || !naIsHash(args[0]))
+        naRuntimeError(c, "gc.hashstats: bad/missing hash");
+    naiHash_probes(args[0], argc > 1 && naTrue(args[1]),
+                   &cells, &mean, &maxprobes, &maxbucket);
+    result = naNewHash(c);
+    setnum(c, result, "keys", naHash_size(args[0]));
+    setnum(c, result, "cells", cells);
+    setnum(c, result, "probes", mean);
+    setnum(c, result, "maxprobes", maxprobes);
+    setnum(c, result, "maxbucket", maxbucket);
+    return result;
+}
+
+static naRef f_finalize(naContext c, naRef me, int argc, naRef* args)
+{
+    return naNum(naGCFinalize());
+}
+
+static naRef f_weakhash(naContext c, naRef me, int argc, naRef* args)
+{
+    return naNewWeakHash(c);
+}
+
+static naCFuncItem funcs[] = {
+    { "stats", f_stats },
+    { "tune", f_tune },
+    { "collect", f_collect },
+    { "snapshot", f_snapshot },
+    { "weakhash", f_weakhash },
+    { "finalize", f_finalize },
+    { "budget", f_budget },
+    { "hashstats", f_hashstats },
+    { 0 }
+};
+
+naRef naInit_gc(naContext c)
+{
+    return naGenLib(c, funcs);
+}
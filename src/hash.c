@@ -1,12 +1,19 @@
 #include <string.h>
 #include "nasal.h"
 #include "data.h"
+#include "code.h"
 
 /* A HashRec lives in a single allocated block.  The layout is the
  * header struct, then a table of 2^lgsz hash entries (key/value
  * pairs), then an index table of 2*2^lgsz integers storing index
  * values into the entry table.  There are two tokens needed for
- * "unused" and "used but empty". */
+ * "unused" and "used but empty".
+ *
+ * A shared hash (naHash_share) can be written by several threads at
+ * once.  Its writers take the hash's lock, but readers take nothing:
+ * they rely on an entry being complete before the index table points
+ * at it, and on a record replaced by resize() not being freed while a
+ * thread may still be reading it (see naGC_swapfree()). */
 
 #define ENT_EMPTY -1
 #define ENT_DELETED -2
@@ -19,6 +26,42 @@ typedef struct HashRec {
     int next; /* next entry to use */
 } HashRec;
 
+/* Hashes made by object literals start out "shaped": instead of a
+ * table of their own, they point to a Shape holding their keys, which
+ * is shared by every hash that had the same keys added in the same
+ * order, and store just the values, in slot order.  Adding a key
+ * moves the hash on to the shape's child for that key, made the first
+ * time and reused after that.  Deleting a key, adding one that isn't
+ * an interned symbol, or going past the limits below turns the hash
+ * into an ordinary table for good.  The ShapeRec holding the values
+ * is told from a HashRec by its lgsz. */
+
+#define SHAPE_KEYS 32    /* keys in a shape */
+#define SHAPE_KIDS 8     /* different keys added to one shape */
+#define SHAPE_MAX 16384  /* shapes per interpreter */
+#define SHAPE_TAB (2*SHAPE_KEYS)
+#define SHAPED -1
+
+struct Shape {
+    int nkeys;
+    naRef* keys;                   /* in slot order */
+    unsigned char tab[SHAPE_TAB];  /* slot+1 by hash code, 0 if empty */
+    volatile int nkids;
+    struct Shape* kids[SHAPE_KIDS];
+    struct Shape* next;            /* all shapes, for the collector */
+};
+
+typedef struct ShapeRec {
+    int size; /* as in a HashRec */
+    int lgsz; /* always SHAPED */
+    int cap;  /* allocated slots, past size they are nil */
+    struct Shape* shape;
+    naRef slots[];
+} ShapeRec;
+
+#define ISSHAPED(hr) ((hr)->lgsz == SHAPED)
+#define SREC(hr) ((ShapeRec*)(hr))
+
 #define REC(h) (PTR(h).hash->rec)
 #define POW2(n) (1<<(n))
 #define NCELLS(hr) (2*POW2((hr)->lgsz))
@@ -26,7 +69,9 @@ typedef struct HashRec {
 #define ALIGN(p,sz) (((char*)p)+ROUNDUPOFF(((size_t)p)%sz,sz))
 #define ENTS(h) ((HashEnt*)ALIGN(&((HashRec*)h)[1],sizeof(naRef)))
 #define TAB(h) ((int*)&(ENTS(h)[1<<(h)->lgsz]))
-#define HBITS(hr,code) ((hr)->lgsz ? ((code)>>(32-(hr)->lgsz)) : 0)
+/* The first cell probed for a hash code: its top bits, enough of them
+ * to reach every cell of the index table */
+#define HBITS(hr,code) ((code)>>(31-(hr)->lgsz))
 
 #define LROT(h,n) (((h)<<n)|((h)>>((8*sizeof(h))-n)))
 static unsigned int mix32(unsigned int h)
@@ -35,7 +80,64 @@ static unsigned int mix32(unsigned int h)
     h += LROT(h, 4);  h -= LROT(h, 1);  h ^= LROT(h, 2);
     return h;
 }
+// String hashing consumes 8 bytes per step, with four independent
+// accumulators over 32 byte stripes so long keys (SQL values,
+// generated identifiers) keep the multipliers busy.  This is the
+// XXH64 algorithm with a zero seed; on little endian machines the
+// values match the reference implementation.  A zero result is
+// remapped, as a zero hashcode marks a string as still mutable.
+typedef unsigned long long u64;
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+#define ROUND(acc, w) (acc += (w) * P2, acc = LROT(acc, 31), acc *= P1)
+
+static u64 read64(const unsigned char* p) { u64 w; memcpy(&w, p, 8); return w; }
+static u64 read32(const unsigned char* p) { unsigned int w; memcpy(&w, p, 4); return w; }
+
+static u64 merge64(u64 h, u64 v)
+{
+    u64 k = 0;
+    ROUND(k, v);
+    return (h ^ k) * P1 + P4;
+}
+
 static unsigned int hash32(const unsigned char* in, int len)
+{
+    const unsigned char* end = in + len;
+    u64 h, k;
+    if(len >= 32) {
+        u64 v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+        do {
+            ROUND(v1, read64(in));    ROUND(v2, read64(in+8));
+            ROUND(v3, read64(in+16)); ROUND(v4, read64(in+24));
+            in += 32;
+        } while(in <= end - 32);
+        h = LROT(v1, 1) + LROT(v2, 7) + LROT(v3, 12) + LROT(v4, 18);
+        h = merge64(merge64(merge64(merge64(h, v1), v2), v3), v4);
+    } else h = P5;
+    h += (u64)len;
+    for(; in + 8 <= end; in += 8) {
+        k = 0; ROUND(k, read64(in));
+        h ^= k; h = LROT(h, 27) * P1 + P4;
+    }
+    if(in + 4 <= end) {
+        h ^= read32(in) * P1; h = LROT(h, 23) * P2 + P3;
+        in += 4;
+    }
+    for(; in < end; in++) {
+        h ^= *in * P5; h = LROT(h, 11) * P1;
+    }
+    h ^= h >> 33; h *= P2; h ^= h >> 29; h *= P3; h ^= h >> 32;
+    return (unsigned int)h ? (unsigned int)h : 1;
+}
+
+/* The string hash used before hash32(), a word at a time through
+ * mix32().  Kept only so that naiHash_probes() can compare the two on
+ * the same keys. */
+static unsigned int oldhash32(const unsigned char* in, int len)
 {
     unsigned int h = len, val = 0;
     int i, count = 0;
@@ -71,29 +173,79 @@ static int equal(naRef a, naRef b)
 }
 
 /* Returns the index of a cell that either contains a matching key, or
- * is the empty slot to receive a new insertion. */
-static int findcell(struct HashRec *hr, naRef key, unsigned int hash)
+ * is the empty slot to receive a new insertion, and stores the entry
+ * it found there (or ENT_EMPTY) in *entp.  Lock-free readers of a
+ * shared hash may race a writer filling that cell, so callers must use
+ * the entry read here and never look at the cell again: each cell is
+ * loaded exactly once. */
+static int findcell(struct HashRec *hr, naRef key, unsigned int hash, int* entp)
 {
-    int i, mask = POW2(hr->lgsz+1)-1, step = (2*hash+1) & mask;
-    for(i=HBITS(hr,hash); TAB(hr)[i] != ENT_EMPTY; i=(i+step)&mask)
-        if(TAB(hr)[i] != ENT_DELETED && equal(key, ENTS(hr)[TAB(hr)[i]].key))
+    volatile int* tab = TAB(hr);
+    int i, ent, mask = POW2(hr->lgsz+1)-1, step = (2*hash+1) & mask;
+    for(i=HBITS(hr,hash); (ent = tab[i]) != ENT_EMPTY; i=(i+step)&mask)
+        if(ent != ENT_DELETED && equal(key, ENTS(hr)[ent].key))
             break;
+    *entp = ent;
     return i;
 }
 
-static void hashset(HashRec* hr, naRef key, naRef val)
+static void hashset(HashRec* hr, naRef key, naRef val, int shared)
 {
-    int ent, cell = findcell(hr, key, refhash(key));
-    if((ent = TAB(hr)[cell]) == ENT_EMPTY) {
+    int ent, cell = findcell(hr, key, refhash(key), &ent);
+    if(ent == ENT_EMPTY) {
         ent = hr->next++;
         if(ent >= NCELLS(hr)) return; /* race protection, don't overrun */
+        ENTS(hr)[ent].key = key;
+        ENTS(hr)[ent].val = val;
+        if(shared) naMemBarrier(); /* publish the entry whole */
         TAB(hr)[cell] = ent;
         hr->size++;
-        ENTS(hr)[ent].key = key;
+        return;
     }
     ENTS(hr)[ent].val = val;
 }
 
+/* Measures how well the keys of an ordinary hash spread over its
+ * index table: they are inserted again, in table order, into a
+ * scratch table of the same size, with strings hashed by hash32() or
+ * (if old is set) oldhash32().  Reports the number of cells, the mean
+ * and largest number probed to insert a key (which is what finding it
+ * costs later), and the most keys wanting the same first cell.  All
+ * zero for an empty or shaped hash. */
+void naiHash_probes(naRef hash, int old, int* cells, double* mean,
+                    int* maxprobes, int* maxbucket)
+{
+    HashRec* hr = REC(hash);
+    int i, n, *used, *home, total = 0;
+    *cells = *maxprobes = *maxbucket = 0;
+    *mean = 0;
+    if(!hr || ISSHAPED(hr) || !hr->size) return;
+    n = NCELLS(hr);
+    used = naAlloc(2 * n * sizeof(int));
+    home = used + n;
+    naBZero(used, 2 * n * sizeof(int));
+    for(i=0; i<n; i++) {
+        naRef key;
+        unsigned int h;
+        int c, step, probes = 1;
+        if(TAB(hr)[i] < 0) continue;
+        key = ENTS(hr)[TAB(hr)[i]].key;
+        h = old && IS_STR(key)
+            ? oldhash32((void*)naStr_data(key), naStr_len(key))
+            : refhash(key);
+        c = HBITS(hr, h);
+        step = (2*h+1) & (n-1);
+        if(++home[c] > *maxbucket) *maxbucket = home[c];
+        for(; used[c]; c = (c+step) & (n-1)) probes++;
+        used[c] = 1;
+        total += probes;
+        if(probes > *maxprobes) *maxprobes = probes;
+    }
+    naFree(used);
+    *cells = n;
+    *mean = total / (double)hr->size;
+}
+
 static int recsize(int lgsz)
 {
     HashRec hr;
@@ -109,26 +261,192 @@ static HashRec* resize(struct naHash* hash)
         int oldsz = hr->size;
         while(oldsz) { oldsz >>= 1; lgsz++; }
     }
-    hr2 = naAlloc(recsize(lgsz));
+    naGC_count(recsize(lgsz)); // may hold the hash's lock
+    hr2 = naArena_alloc(recsize(lgsz));
     hr2->size = hr2->next = 0;
     hr2->lgsz = lgsz;
     for(i=0; i<(2*(1<<lgsz)); i++)
         TAB(hr2)[i] = ENT_EMPTY;
+    if(hr && ISSHAPED(hr)) {
+        for(i=0; i < hr->size; i++)
+            hashset(hr2, SREC(hr)->shape->keys[i], SREC(hr)->slots[i], 0);
+        hr = 0;
+    }
     for(i=0; hr && i < POW2(hr->lgsz+1); i++)
         if(TAB(hr)[i] >= 0)
-            hashset(hr2, ENTS(hr)[TAB(hr)[i]].key, ENTS(hr)[TAB(hr)[i]].val);
+            hashset(hr2, ENTS(hr)[TAB(hr)[i]].key, ENTS(hr)[TAB(hr)[i]].val, 0);
     naGC_swapfree((void*)&hash->rec, hr2);
     return hr2;
 }
 
+/* Writers to a shared hash spin instead of blocking, as the holder
+ * may need a collection (to free the record it replaced), which has
+ * to wait for every thread to stop. */
+static void lockhash(struct naHash* h)
+{
+    while(!naAtomicCAS(&h->lock, 0, 1))
+        naCheckBottleneck();
+}
+
+static void unlockhash(struct naHash* h)
+{
+    naMemBarrier();
+    h->lock = 0;
+}
+
+static int shapeslot(struct Shape* s, naRef key)
+{
+    int i, slot;
+    if(!IS_STR(key)) return -1;
+    for(i=refhash(key) & (SHAPE_TAB-1); (slot = s->tab[i]); i=(i+1) & (SHAPE_TAB-1))
+        if(equal(key, s->keys[slot-1]))
+            return slot-1;
+    return -1;
+}
+
+static struct Shape* newshape(struct Shape* parent, naRef key)
+{
+    int i, n = parent ? parent->nkeys : 0;
+    struct Shape* s = naAlloc(sizeof(struct Shape));
+    naBZero(s, sizeof(struct Shape));
+    if(parent) {
+        s->nkeys = n + 1;
+        s->keys = naAlloc(s->nkeys * sizeof(naRef));
+        memcpy(s->keys, parent->keys, n * sizeof(naRef));
+        memcpy(s->tab, parent->tab, SHAPE_TAB);
+        s->keys[n] = key;
+        for(i=refhash(key) & (SHAPE_TAB-1); s->tab[i]; i=(i+1) & (SHAPE_TAB-1));
+        s->tab[i] = n + 1;
+    }
+    s->next = globals->shapes;
+    globals->shapes = s;
+    globals->nShapes++;
+    return s;
+}
+
+static struct Shape* rootshape()
+{
+    struct Globals* g = globals;
+    if(!g->rootShape) {
+        naLock(g->shapeLock);
+        if(!g->rootShape) g->rootShape = newshape(0, naNil());
+        naUnlock(g->shapeLock);
+    }
+    return g->rootShape;
+}
+
+/* Returns the child of s with the key added, or null if there can't
+ * be one.  The key must be an interned symbol. */
+static struct Shape* addkey(struct Shape* s, naRef key)
+{
+    struct Globals* g = globals;
+    int i, n = s->nkids;
+    struct Shape* kid = 0;
+    for(i=0; i<n; i++)
+        if(PTR(s->kids[i]->keys[s->nkeys]).str == PTR(key).str)
+            return s->kids[i];
+    if(s->nkeys >= SHAPE_KEYS) return 0;
+    naLock(g->shapeLock);
+    for(i=n; !kid && i<s->nkids; i++)
+        if(PTR(s->kids[i]->keys[s->nkeys]).str == PTR(key).str)
+            kid = s->kids[i];
+    if(!kid && s->nkids < SHAPE_KIDS && g->nShapes < SHAPE_MAX) {
+        kid = newshape(s, key);
+        s->kids[s->nkids] = kid;
+        naMemBarrier();
+        s->nkids++;
+    }
+    naUnlock(g->shapeLock);
+    return kid;
+}
+
+/* The interned symbol equal to key, or nil */
+static naRef symkey(naRef key)
+{
+    naRef sym;
+    if(!IS_STR(key)) return naNil();
+    if(PTR(key).str->sym) return key;
+    if(naHash_get(globals->symbols, key, &sym) && PTR(sym).str->sym)
+        return sym;
+    return naNil();
+}
+
+/* Turns a shaped hash into an ordinary one */
+static void unshape(struct naHash* h)
+{
+    h->shaped = 0;
+    if(h->rec) resize(h);
+}
+
+/* Sets a key in a shaped hash, or turns it into an ordinary one and
+ * returns zero if the key doesn't fit. */
+static int shapeset(struct naHash* h, naRef key, naRef val)
+{
+    int i, cap;
+    ShapeRec *sr = SREC(h->rec), *sr2;
+    struct Shape *s, *kid;
+    if(sr && !ISSHAPED(sr)) return 0; /* lost a race to unshape() */
+    s = sr ? sr->shape : rootshape();
+    if(sr && (i = shapeslot(s, key)) >= 0) {
+        sr->slots[i] = val;
+        return 1;
+    }
+    key = symkey(key);
+    if(IS_NIL(key) || !(kid = addkey(s, key))) {
+        unshape(h);
+        return 0;
+    }
+    if(sr && s->nkeys < sr->cap) {
+        sr->slots[s->nkeys] = val;
+        sr->shape = kid;
+        sr->size = kid->nkeys;
+        return 1;
+    }
+    cap = sr ? 2*sr->cap : 4;
+    naGC_spend(0, sizeof(ShapeRec) + cap * sizeof(naRef)); /* never shared */
+    sr2 = naArena_alloc(sizeof(ShapeRec) + cap * sizeof(naRef));
+    sr2->lgsz = SHAPED;
+    sr2->cap = cap;
+    for(i=0; i<cap; i++)
+        sr2->slots[i] = i < s->nkeys ? sr->slots[i] : naNil();
+    sr2->slots[s->nkeys] = val;
+    sr2->shape = kid;
+    sr2->size = kid->nkeys;
+    naGC_swapfree((void*)&h->rec, sr2);
+    return 1;
+}
+
+static void sethash(struct naHash* h, naRef key, naRef val)
+{
+    HashRec* hr;
+    if(h->shaped && shapeset(h, key, val)) return;
+    hr = h->rec;
+    if(!hr || hr->next >= POW2(hr->lgsz))
+        hr = resize(h);
+    hashset(hr, key, val, h->shared);
+}
+
+void naHash_share(naRef hash)
+{
+    if(!IS_HASH(hash)) return;
+    if(PTR(hash).hash->shaped) unshape(PTR(hash).hash);
+    PTR(hash).hash->shared = 1;
+}
+
 int naHash_size(naRef h) { return REC(h) ? REC(h)->size : 0; }
 
 int naHash_get(naRef hash, naRef key, naRef* out)
 {
     HashRec* hr = REC(hash);
-    if(hr) {
-        int ent, cell = findcell(hr, key, refhash(key));
-        if((ent = TAB(hr)[cell]) < 0) return 0;
+    if(hr && ISSHAPED(hr)) {
+        int slot = shapeslot(SREC(hr)->shape, key);
+        if(slot < 0) return 0;
+        *out = SREC(hr)->slots[slot];
+        return 1;
+    } else if(hr) {
+        int ent;
+        findcell(hr, key, refhash(key), &ent);
+        if(ent < 0) return 0;
         *out = ENTS(hr)[ent].val;
         return 1;
     }
@@ -137,29 +455,39 @@ int naHash_get(naRef hash, naRef key, naRef* out)
 
 void naHash_set(naRef hash, naRef key, naRef val)
 {
-    HashRec* hr = REC(hash);
-    if(!hr || hr->next >= POW2(hr->lgsz))
-        hr = resize(PTR(hash).hash);
-    hashset(hr, key, val);
+    struct naHash* h = PTR(hash).hash;
+    if(h->shared) lockhash(h);
+    sethash(h, key, val);
+    if(h->shared) unlockhash(h);
 }
 
 void naHash_delete(naRef hash, naRef key)
 {
-    HashRec* hr = REC(hash);
-    if(hr) {
-        int cell = findcell(hr, key, refhash(key));
-        if(TAB(hr)[cell] >= 0) {
+    struct naHash* h = PTR(hash).hash;
+    HashRec* hr;
+    if(h->shared) lockhash(h);
+    if(h->shaped && h->rec && shapeslot(SREC(h->rec)->shape, key) >= 0)
+        unshape(h);
+    if((hr = h->rec) && !ISSHAPED(hr)) {
+        int ent, cell = findcell(hr, key, refhash(key), &ent);
+        if(ent >= 0) {
             TAB(hr)[cell] = ENT_DELETED;
             if(--hr->size < POW2(hr->lgsz-1))
-                resize(PTR(hash).hash);
+                resize(h);
         }
     }
+    if(h->shared) unlockhash(h);
 }
 
 void naHash_keys(naRef dst, naRef hash)
 {
     int i;
     HashRec* hr = REC(hash);
+    if(hr && ISSHAPED(hr)) {
+        for(i=0; i < hr->size; i++)
+            naVec_append(dst, SREC(hr)->shape->keys[i]);
+        return;
+    }
     for(i=0; hr && i < NCELLS(hr); i++)
         if(TAB(hr)[i] >= 0)
             naVec_append(dst, ENTS(hr)[TAB(hr)[i]].key);
@@ -169,6 +497,11 @@ void naiGCMarkHash(naRef hash)
 {
     int i;
     HashRec* hr = REC(hash);
+    if(hr && ISSHAPED(hr)) {
+        for(i=0; i < hr->size; i++)
+            naiGCMark(SREC(hr)->slots[i]);
+        return;
+    }
     for(i=0; hr && i < NCELLS(hr); i++)
         if(TAB(hr)[i] >= 0) {
             naiGCMark(ENTS(hr)[TAB(hr)[i]].key);
@@ -176,10 +509,68 @@ void naiGCMarkHash(naRef hash)
         }
 }
 
+// Calls fn on each key and value slot, for the collector.  The keys
+// of a shaped hash belong to its shape.
+void naiGCHashRefs(struct naHash* h, void (*fn)(naRef*))
+{
+    int i;
+    HashRec* hr = h->rec;
+    if(hr && ISSHAPED(hr)) {
+        for(i=0; i < hr->size; i++)
+            fn(&SREC(hr)->slots[i]);
+        return;
+    }
+    for(i=0; hr && i < NCELLS(hr); i++)
+        if(TAB(hr)[i] >= 0) {
+            fn(&ENTS(hr)[TAB(hr)[i]].key);
+            fn(&ENTS(hr)[TAB(hr)[i]].val);
+        }
+}
+
+// Calls fn on each key/value pair, for the collector
+void naiGCHashPairs(struct naHash* h, void (*fn)(naRef, naRef))
+{
+    int i;
+    HashRec* hr = h->rec;
+    if(hr && ISSHAPED(hr)) {
+        for(i=0; i < hr->size; i++)
+            fn(SREC(hr)->shape->keys[i], SREC(hr)->slots[i]);
+        return;
+    }
+    for(i=0; hr && i < NCELLS(hr); i++)
+        if(TAB(hr)[i] >= 0)
+            fn(ENTS(hr)[TAB(hr)[i]].key, ENTS(hr)[TAB(hr)[i]].val);
+}
+
+// Calls fn on the keys of every shape (just the newest of each, as
+// the rest are the keys of its ancestors)
+void naiGCShapeKeys(void (*fn)(naRef))
+{
+    struct Shape* s;
+    for(s = globals->shapes; s; s = s->next)
+        if(s->nkeys) fn(s->keys[s->nkeys-1]);
+}
+
+// Drops the entries whose keys are not live, for the collector.  The
+// table is left as is (it can't be reallocated during a collection);
+// the next resize reclaims the space.  Weak hashes are never shaped.
+void naiGCHashSweep(struct naHash* h, int (*live)(naRef))
+{
+    int i;
+    HashRec* hr = h->rec;
+    for(i=0; hr && !ISSHAPED(hr) && i < NCELLS(hr); i++)
+        if(TAB(hr)[i] >= 0 && !live(ENTS(hr)[TAB(hr)[i]].key)) {
+            TAB(hr)[i] = ENT_DELETED;
+            hr->size--;
+        }
+}
+
 static void tmpStr(naRef* out, struct naStr* str, const char* key)
 {
     str->type = T_STR;
-    str->hashcode = str->emblen = 0;
+    str->hashcode = 0;
+    str->emblen = -1;
+    str->sym = 0;
     str->data.ref.ptr = (unsigned char*)key;
     str->data.ref.len = strlen(key);
     SETPTR(*out, str);
@@ -209,17 +600,24 @@ void naHash_cset(naRef hash, char* key, naRef val)
 
 int naiHash_tryset(naRef hash, naRef key, naRef val)
 {
-    HashRec* hr = REC(hash);
-    if(hr) {
-        int ent, cell = findcell(hr, key, refhash(key));
-        if((ent = TAB(hr)[cell]) >= 0) { ENTS(hr)[ent].val = val; return 1; }
+    struct naHash* h = PTR(hash).hash;
+    HashRec* hr;
+    int ent = ENT_EMPTY;
+    if(h->shared) lockhash(h);
+    if((hr = h->rec) && ISSHAPED(hr)) {
+        ent = shapeslot(SREC(hr)->shape, key);
+        if(ent >= 0) SREC(hr)->slots[ent] = val;
+    } else if(hr) {
+        findcell(hr, key, refhash(key), &ent);
+        if(ent >= 0) ENTS(hr)[ent].val = val;
     }
-    return 0;
+    if(h->shared) unlockhash(h);
+    return ent >= 0;
 }
 
 void naiGCHashClean(struct naHash* h)
 {
-    naFree(h->rec);
+    naArena_free(h->rec);
     h->rec = 0;
 }
 
@@ -231,14 +629,22 @@ void naiGCHashClean(struct naHash* h)
 int naiHash_sym(struct naHash* hash, struct naStr* sym, naRef* out)
 {
     HashRec* hr = hash->rec;
-    if(hr) {
+    if(hr && ISSHAPED(hr)) {
+        struct Shape* s = SREC(hr)->shape;
+        int i, slot;
+        for(i=sym->hashcode & (SHAPE_TAB-1); (slot = s->tab[i]); i=(i+1) & (SHAPE_TAB-1))
+            if(sym == PTR(s->keys[slot-1]).str) {
+                *out = SREC(hr)->slots[slot-1];
+                return 1;
+            }
+    } else if(hr) {
         int* tab = TAB(hr);
         HashEnt* ents = ENTS(hr);
         unsigned int hc = sym->hashcode;
-        int cell, mask = POW2(hr->lgsz+1) - 1, step = (2*hc+1) & mask;
-        for(cell=HBITS(hr,hc); tab[cell] != ENT_EMPTY; cell=(cell+step)&mask)
-            if(tab[cell]!=ENT_DELETED && sym==PTR(ents[tab[cell]].key).str) {
-                *out = ents[tab[cell]].val;
+        int ent, cell, mask = POW2(hr->lgsz+1) - 1, step = (2*hc+1) & mask;
+        for(cell=HBITS(hr,hc); (ent = tab[cell]) != ENT_EMPTY; cell=(cell+step)&mask)
+            if(ent != ENT_DELETED && sym == PTR(ents[ent].key).str) {
+                *out = ents[ent].val;
                 return 1;
             }
     }
@@ -248,12 +654,22 @@ int naiHash_sym(struct naHash* hash, struct naStr* sym, naRef* out)
 
 /* As above, a special naHash_set for setting local variables.
  * Assumes that the key is interned, and also that it isn't already
- * present in the hash. */
+ * present in the hash (unless it is shared). */
 void naiHash_newsym(struct naHash* hash, naRef* sym, naRef* val)
 {
     HashRec* hr = hash->rec;
     int mask, step, cell, ent;
     struct naStr *s = PTR(*sym).str;
+    if(hash->shared) {
+        /* Another thread may have added it meanwhile */
+        lockhash(hash);
+        sethash(hash, *sym, *val);
+        unlockhash(hash);
+        return;
+    } else if(hash->shaped) {
+        sethash(hash, *sym, *val);
+        return;
+    }
     if(!hr || hr->next >= POW2(hr->lgsz))
         hr = resize(hash);
     mask = POW2(hr->lgsz+1) - 1;
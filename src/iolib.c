@@ -95,7 +95,7 @@ static void ioclose(naContext c, void* f)
 static int ioread(naContext c, void* f, char* buf, unsigned int len)
 {
     int n;
-    naModUnlock(); n = fread(buf, 1, len, f); naModLock();
+    naEnterNative(); n = fread(buf, 1, len, f); naLeaveNative();
     if(n < len && !feof((FILE*)f)) naRuntimeError(c, strerror(errno));
     return n;
 }
@@ -103,7 +103,7 @@ static int ioread(naContext c, void* f, char* buf, unsigned int len)
 static int iowrite(naContext c, void* f, char* buf, unsigned int len)
 {
     int n;
-    naModUnlock(); n = fwrite(buf, 1, len, f); naModLock();
+    naEnterNative(); n = fwrite(buf, 1, len, f); naLeaveNative();
     if(ferror((FILE*)f)) naRuntimeError(c, strerror(errno));
     return n;
 }
@@ -122,7 +122,9 @@ static int iotell(naContext c, void* f)
 
 static void ioflush(naContext c, void* f)
 {
-    if(fflush(f)) naRuntimeError(c, strerror(errno));
+    int err;
+    naEnterNative(); err = fflush(f); naLeaveNative();
+    if(err) naRuntimeError(c, strerror(errno));
 }
 
 static void iodestroy(void* f)
@@ -148,7 +150,9 @@ static naRef f_open(naContext c, naRef me, int argc, naRef* args)
     naRef file = argc > 0 ? naStringValue(c, args[0]) : naNil();
     naRef mode = argc > 1 ? naStringValue(c, args[1]) : naNil();
     if(!IS_STR(file)) naRuntimeError(c, "bad argument to open()");
+    naEnterNative();
     f = fopen(naStr_data(file), IS_STR(mode) ? naStr_data(mode) : "rb");
+    naLeaveNative();
     if(!f) naRuntimeError(c, strerror(errno));
     return naIOGhost(c, f);
 }
@@ -157,7 +161,7 @@ static naRef f_open(naContext c, naRef me, int argc, naRef* args)
 static int getcguard(naContext ctx, FILE* f, void* buf)
 {
     int c;
-    naModUnlock(); c = fgetc(f); naModLock();
+    naEnterNative(); c = fgetc(f); naLeaveNative();
     if(ferror(f)) {
         naFree(buf);
         naRuntimeError(ctx, strerror(errno));
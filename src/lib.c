@@ -26,6 +26,8 @@ static naRef f_size(naContext c, naRef me, int argc, naRef* args)
     if(naIsString(args[0])) return naNum(naStr_len(args[0]));
     if(naIsVector(args[0])) return naNum(naVec_size(args[0]));
     if(naIsHash(args[0])) return naNum(naHash_size(args[0]));
+    if(naIsGhost(args[0]) && naGhost_type(args[0])->size)
+        return naNum(naGhost_type(args[0])->size(naGhost_ptr(args[0])));
     naRuntimeError(c, "object has no size()");
     return naNil();
 }
@@ -55,8 +57,11 @@ static naRef f_pop(naContext c, naRef me, int argc, naRef* args)
 
 static naRef f_setsize(naContext c, naRef me, int argc, naRef* args)
 {
+    int sz;
     if(argc < 2 || !naIsVector(args[0])) ARGERR();
-    naVec_setsize(args[0], (int)naNumValue(args[1]).num);
+    sz = (int)naNumValue(args[1]).num;
+    naGC_reserve(c, sizeof(struct VecRec) + sizeof(naRef) * (long)sz);
+    naVec_setsize(args[0], sz);
     return args[0];
 }
 
@@ -324,13 +329,53 @@ static char* nextFormat(naContext c, char* f, char** out, int* len, char* type)
     return f;
 }
 
+// Concatenates the strings in a vector with sep between them.  The
+// result is sized once up front, so building a string from n pieces
+// costs O(n) instead of the O(n^2) of repeated naStr_concat() calls.
+// Numbers are converted (into a side vector, the input is left
+// alone); anything else is an error.  A nil sep means none.
+static naRef join(naContext c, naRef sep, naRef v)
+{
+    int i, n = naVec_size(v), len = 0, sl = IS_NIL(sep) ? 0 : naStr_len(sep);
+    naRef s, conv = naNil(), result;
+    char* p;
+    for(i=0; i<n; i++) {
+        s = naVec_get(v, i);
+        if(!IS_STR(s)) {
+            if(IS_NIL(s = naStringValue(c, s)))
+                naRuntimeError(c, "join(): element %d not a scalar", i);
+            if(IS_NIL(conv)) { conv = naNewVector(c); naVec_setsize(conv, n); }
+            naVec_set(conv, i, s);
+        }
+        len += naStr_len(s) + (i ? sl : 0);
+    }
+    result = naStr_buf(naNewString(c), len);
+    p = naStr_data(result);
+    for(i=0; i<n; i++) {
+        if(i && sl) { memcpy(p, naStr_data(sep), sl); p += sl; }
+        s = naVec_get(v, i);
+        if(!IS_STR(s)) s = naVec_get(conv, i);
+        memcpy(p, naStr_data(s), naStr_len(s));
+        p += naStr_len(s);
+    }
+    return result;
+}
+
+static naRef f_join(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef sep = argc > 0 ? naStringValue(c, args[0]) : naNil();
+    naRef v = argc > 1 ? args[1] : naNil();
+    if(!IS_STR(sep) || !IS_VEC(v)) ARGERR();
+    return join(c, sep, v);
+}
+
 #define ERR(m) naRuntimeError(c, m)
-#define APPEND(r) result = naStr_concat(naNewString(c), result, r)
+#define APPEND(r) naVec_append(parts, r)
 static naRef f_sprintf(naContext c, naRef me, int argc, naRef* args)
 {
     char t, nultmp, *fstr, *next, *fout=0, *s;
     int flen, argn=1;
-    naRef format, arg, result = naNewString(c);
+    naRef format, arg, parts = naNewVector(c);
 
     if(argc < 1) ERR("not enough arguments to sprintf()");
     format = naStringValue(c, argc > 0 ? args[0] : naNil());
@@ -371,7 +416,7 @@ static naRef f_sprintf(naContext c, naRef me, int argc, naRef* args)
         s = next;
     }
     APPEND(NEWSTR(c, s, strlen(s)));
-    return result;
+    return join(c, naNil(), parts);
 }
 
 // FIXME: needs to honor subcontext list
@@ -585,6 +630,7 @@ static naCFuncItem funcs[] = {
     { "closure", f_closure },
     { "find", f_find },
     { "split", f_split },
+    { "join", f_join },
     { "rand", f_rand },
     { "bind", f_bind },
     { "sort", f_sort },
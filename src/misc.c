@@ -1,6 +1,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "nasal.h"
 #include "code.h"
@@ -10,6 +13,36 @@ void* naAlloc(int n) { return malloc(n); }
 void* naRealloc(void* b, int n) { return realloc(b, n); }
 void naBZero(void* m, int n) { memset(m, 0, n); }
 
+// Allocates n bytes aligned on a multiple of align (a power of two)
+void* naAllocAligned(int n, int align)
+{
+#ifdef _WIN32
+    return _aligned_malloc(n, align);
+#else
+    void* m;
+    return posix_memalign(&m, align, n) ? 0 : m;
+#endif
+}
+
+void naFreeAligned(void* m)
+{
+#ifdef _WIN32
+    _aligned_free(m);
+#else
+    free(m);
+#endif
+}
+
+// Asks the C library to hand free heap pages back to the OS, where it
+// knows how.  Freeing memory in the middle of the heap otherwise
+// doesn't shrink the process.
+void naReleaseMemory()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
 void naTempSave(naContext c, naRef r)
 {
     int i;
@@ -66,9 +99,12 @@ naRef naStringValue(naContext c, naRef r)
 naRef naNew(struct Context* c, int type)
 {
     naRef result;
-    if(c->nfree[type] == 0)
-        c->free[type] = naGC_get(&globals->pools[type],
-                                 OBJ_CACHE_SZ, &c->nfree[type]);
+    naGC_spend(1, 0);
+    if(c->nfree[type] == 0) {
+        c->free[type] = naGC_get(&c->isolate->pools[type],
+                                 c->cachesz[type], &c->nfree[type]);
+        if(c->cachesz[type] < OBJ_CACHE_SZ) c->cachesz[type] *= 2;
+    }
     result = naObj(type, c->free[type][--c->nfree[type]]);
     naTempSave(c, result);
     return result;
@@ -81,6 +117,7 @@ naRef naNewString(struct Context* c)
     PTR(s).str->data.ref.len = 0;
     PTR(s).str->data.ref.ptr = 0;
     PTR(s).str->hashcode = 0;
+    PTR(s).str->sym = 0;
     return s;
 }
 
@@ -95,6 +132,25 @@ naRef naNewHash(struct Context* c)
 {
     naRef r = naNew(c, T_HASH);
     PTR(r).hash->rec = 0;
+    PTR(r).hash->weak = 0;
+    PTR(r).hash->shared = 0;
+    PTR(r).hash->shaped = 0;
+    PTR(r).hash->lock = 0;
+    return r;
+}
+
+// Object literals start out sharing their keys with others like them
+naRef naNewShapedHash(struct Context* c)
+{
+    naRef r = naNewHash(c);
+    PTR(r).hash->shaped = 1;
+    return r;
+}
+
+naRef naNewWeakHash(struct Context* c)
+{
+    naRef r = naNewHash(c);
+    PTR(r).hash->weak = 1;
     return r;
 }
 
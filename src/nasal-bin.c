@@ -100,6 +100,12 @@ int main(int argc, char** argv)
     naAddSym(ctx, namespace, "io", naInit_io(ctx));
     naAddSym(ctx, namespace, "unix", naInit_unix(ctx));
     naAddSym(ctx, namespace, "thread", naInit_thread(ctx));
+    naAddSym(ctx, namespace, "gc", naInit_gc(ctx));
+    naAddSym(ctx, namespace, "coroutine", naInit_coroutine(ctx));
+    naAddSym(ctx, namespace, "array", naInit_array(ctx));
+#ifdef HAVE_EPOLL
+    naAddSym(ctx, namespace, "event", naInit_event(ctx));
+#endif
 #ifdef HAVE_PCRE
     naAddSym(ctx, namespace, "regex", naInit_regex(ctx));
 #endif
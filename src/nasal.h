@@ -84,6 +84,12 @@ naRef naCall(naContext ctx, naRef func, int argc, naRef* args,
 // naModUnlock() first if the lock is already held.
 naRef naContinue(naContext ctx);
 
+// As naContinue(), but the interrupted function call returns value
+// instead of nil.  A C function can use this to suspend a script,
+// by raising an error, and later resume it with the function's real
+// result (see eventlib.c).
+naRef naContinueWith(naContext ctx, naRef value);
+
 // Throw an error from the current call stack.  This function makes a
 // longjmp call to a handler in naCall() and DOES NOT RETURN.  It is
 // intended for use in library code that cannot otherwise report an
@@ -113,6 +119,10 @@ naRef naInit_io(naContext c);
 naRef naInit_regex(naContext c);
 naRef naInit_unix(naContext c);
 naRef naInit_thread(naContext c);
+naRef naInit_gc(naContext c);
+naRef naInit_event(naContext c);
+naRef naInit_coroutine(naContext c);
+naRef naInit_array(naContext c);
 naRef naInit_utf8(naContext c);
 naRef naInit_sqlite(naContext c);
 naRef naInit_readline(naContext c);
@@ -145,6 +155,17 @@ naRef naNewHash(naContext c);
 naRef naNewFunc(naContext c, naRef code);
 naRef naNewCCode(naContext c, naCFunction fptr);
 
+// A hash whose entries are dropped by the garbage collector once
+// their (string) keys are not referenced from anywhere else.  A value
+// referenced only through such an entry is not kept alive by it.
+naRef naNewWeakHash(naContext c);
+
+// Marks a hash as shared between threads, such as a module namespace
+// that several of them update.  Writers to it then take a lock, so
+// that concurrent insertions are not lost to a resize; readers still
+// take none.
+void naHash_share(naRef hash);
+
 // Some useful conversion/comparison routines
 int naEqual(naRef a, naRef b) GCC_PURE;
 int naStrEqual(naRef a, naRef b) GCC_PURE;
@@ -181,12 +202,51 @@ void naHash_keys(naRef dst, naRef hash);
 typedef struct naGhostType {
     void(*destroy)(void*);
     const char* name;
+    // Optional.  Calls fn on a pointer to each naRef the ghost holds,
+    // keeping them alive while the ghost is (and updating them if the
+    // objects move).  Runs inside a collection, so the naRefs must
+    // only be changed with the mod lock held.
+    void(*refs)(void* ghost, void(*fn)(naRef*));
+    // Optional.  Lets a foreach loop run over the ghost: returns each
+    // value in turn, then sets *done instead.  Called with the mod
+    // lock held, and may raise errors in c.
+    naRef(*next)(naContext c, void* ghost, int* done);
+    // Optional, but size and get go together.  They make the ghost
+    // indexable like a vector: size() returns its length, and g[i],
+    // slices and foreach (if there is no next) read its elements with
+    // get.  With set, g[i] = v writes them too.  The index is already
+    // checked, and negative ones counted from the end.  Called with
+    // the mod lock held, and may raise errors in c.
+    int(*size)(void* ghost);
+    naRef(*get)(naContext c, void* ghost, int i);
+    void(*set)(naContext c, void* ghost, int i, naRef val);
+    // Optional.  Returns the bytes the ghost keeps allocated outside
+    // itself, counted against memory budgets while it is reachable
+    // (see naSetBudget()).  Called inside a collection, so it must
+    // neither allocate nor lock.
+    long(*bytes)(void* ghost);
 } naGhostType;
 naRef        naNewGhost(naContext c, naGhostType* t, void* ghost);
 naGhostType* naGhost_type(naRef ghost);
 void*        naGhost_ptr(naRef ghost);
 int          naIsGhost(naRef r);
 
+// Isolates are independent interpreters in one process, each with its
+// own heap, symbol table and garbage collector, so that threads in
+// one never wait for another.  Objects must not be passed between
+// them.  A thread works in one isolate at a time: naNewContext()
+// makes a context in the calling thread's current isolate (a default
+// one, created once on first use by any thread, unless naSetIsolate()
+// was called; the mod lock and the naNew*() functions work on it the
+// same way, as they always have), and
+// naCall() and naContinue() switch the thread to their context's
+// isolate.  naSetIsolate(0) selects the default.  Isolates are not
+// freed.
+typedef struct Globals* naIsolate;
+naIsolate naNewIsolate();
+naIsolate naGetIsolate();
+void naSetIsolate(naIsolate iso);
+
 // Acquires a "modification lock" on a context, allowing the C code to
 // modify Nasal data without fear that such data may be "lost" by the
 // garbage collector (nasal data on the C stack is not examined in
@@ -209,6 +269,104 @@ int          naIsGhost(naRef r);
 void naModLock();
 void naModUnlock();
 
+// Brackets a blocking call (I/O, sleeping, waiting on another thread)
+// in a naCFunction, putting the thread in the "native" state where
+// other threads can collect garbage without waiting for it.  Works
+// like naModUnlock() followed by naModLock(), except that the pairs
+// nest, so helpers can use them without knowing whether a caller
+// already has.  The same rules apply to naRefs held across the call.
+// The library functions that block do this themselves.
+void naEnterNative();
+void naLeaveNative();
+
+// Garbage collector statistics, filled in by naGCStats().  Times are
+// in seconds.  The per-type counts are as of the end of the last
+// collection, indexed in the order: string, vector, hash, code, func,
+// ccode, ghost.
+#define NA_GC_NTYPES 7
+typedef struct {
+    int collections;         // number of collections run so far
+    double pauseTotal;       // time spent with all threads stopped
+    double pauseMax;         // longest single stop
+    double waitTotal;        // time threads spent blocked waiting for a stop
+    int stops;               // times all threads were stopped
+    double ttspTotal;        // time from requesting a stop to all threads
+    double ttspMax;          // reaching a safe point, and the longest
+    int live[NA_GC_NTYPES];  // objects reachable at the last collection
+    int free[NA_GC_NTYPES];  // objects available for allocation after it
+    long arenaUsed;          // bytes of string/vector/hash storage in use
+    long arenaSize;          // bytes allocated for that storage
+    long released;           // bytes of blocks and pages freed so far
+    int compactions;         // number of compacting collections
+    long moved;              // objects moved by them
+    long finalized;          // ghost destructors run
+} naGCInfo;
+void naGCStats(naGCInfo* out);
+
+// Growth heuristics for the collector.  After a collection, a pool
+// with less than minFree of its objects free is grown until there are
+// growFree free objects for every object in use.  The next collection
+// runs after allocRatio times the pool size further allocations.
+//
+// If compact is nonzero, blocks of strings, vectors, hashes and
+// functions that are less than that fraction full get evacuated by
+// an occasional compacting collection so they can be freed.  This
+// moves objects: it is only safe if C code keeps no naRef across a
+// naCall() or naModUnlock() that isn't reachable from its context's
+// stack or a naSave().  Threads between naEnterNative() and
+// naLeaveNative() are assumed to hold some, and put compaction off
+// until they leave.  Off by default.
+typedef struct {
+    double minFree;    // default 0.25
+    double growFree;   // default 0.5
+    double allocRatio; // default 0.5
+    double compact;    // default 0
+} naGCTuning;
+void naGCGetTuning(naGCTuning* out);
+void naGCSetTuning(naGCTuning* t);
+
+// Stops all threads and writes the graph of reachable objects to the
+// named file (see gc.c for the format), for offline analysis with
+// gc.analyze() from lib/gc.nas.  Returns zero if the file could not
+// be written.
+int naGCSnapshot(const char* file);
+
+// Keeps an object alive (and where it is) while C code holds a
+// reference to it outside of any context, e.g. for another thread.
+// Returns a key for naGCRelease().  Unlike naSave(), can be undone.
+int naGCSave(naRef r);
+void naGCRelease(int key);
+
+// Limits the memory a context and the subcontexts it calls may keep
+// reachable from their stacks: a number of objects and of bytes
+// (including string, vector and hash storage, and what ghosts report
+// through naGhostType.bytes).  Zero means no limit.
+// Allocations made while the context runs are charged to it as they
+// happen.  Going over the budget (after a collection has been forced
+// to check what is still reachable) raises a catchable "memory budget
+// exceeded" runtime error at the context's next safe point: the loop
+// iteration, call or return after the allocation, so C functions are
+// never interrupted by it.  C functions making one large allocation on
+// a script's behalf check first and fail before making it.  To handle
+// the error, the context may then use an eighth of its budget more
+// than it was using, until a collection finds it back within the
+// budget.  Each collection resets the usage to what the context's
+// stacks reach.  An object shared between budgeted contexts is charged
+// to the one that allocated it until the next collection, and after
+// that to the first budgeted context the collector finds it from.
+// Work done for the context on other threads, e.g. by a thread pool,
+// is not charged to it.  naGetBudget() returns the current usage.
+void naSetBudget(naContext c, long objects, long bytes);
+void naGetBudget(naContext c, long* objects, long* bytes);
+
+// The destroy functions of collected ghosts are not run during the
+// collection (when every thread is stopped) but queued, and run soon
+// afterwards by the next interpreter thread to reach a safe point (a
+// loop iteration, call or return), outside the mod lock.  This runs
+// any that are pending immediately, returning how many.  Destructors
+// must not use the Nasal heap.
+int naGCFinalize();
+
 // Library utilities.  Generate namespaces and add symbols.
 typedef struct { char* name; naCFunction func; } naCFuncItem;
 naRef naGenLib(naContext c, naCFuncItem *funcs);
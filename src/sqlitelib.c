@@ -29,11 +29,15 @@ static void stmtDestroy(struct StmtGhost* g)
 
 static naRef f_open(naContext c, naRef me, int argc, naRef* args)
 {
+    int err;
     struct DBGhost* g;
     if(argc < 1 || !naIsString(args[0]))
         naRuntimeError(c, "Bad/missing argument to sqlite.open");
     g = malloc(sizeof(struct DBGhost));
-    if(sqlite3_open(naStr_data(args[0]), &g->db)) {
+    naEnterNative();
+    err = sqlite3_open(naStr_data(args[0]), &g->db);
+    naLeaveNative();
+    if(err) {
         const char* msg = sqlite3_errmsg(g->db);
         sqlite3_close(g->db);
         free(g);
@@ -81,7 +85,12 @@ static naRef run_query(naContext c, sqlite3* db, sqlite3_stmt* stmt,
     naRef* fields = 0;
     naRef val, row, result = subc ? naNil() : naNewVector(c);
     int i, cols=0, stat;
-    while((stat = sqlite3_step(stmt)) != SQLITE_DONE) {
+    while(1) {
+        // Steps can wait up to the busy timeout on a locked database
+        naEnterNative();
+        stat = sqlite3_step(stmt);
+        naLeaveNative();
+        if(stat == SQLITE_DONE) break;
         if(stat != SQLITE_ROW)
             naRuntimeError(c, "sqlite step error: %s", sqlite3_errmsg(db));
         if(!fields) {
@@ -89,9 +98,8 @@ static naRef run_query(naContext c, sqlite3* db, sqlite3_stmt* stmt,
             fields = malloc(cols * sizeof(naRef));
             for(i=0; i<cols; i++) {
                 const char* s = sqlite3_column_name(stmt, i);
-                naRef fn = naStr_fromdata(naNewString(c), (char*)s, strlen(s));
-                // Do we really want to use the global intern table here?
-                fields[i] = naInternSymbol(fn);
+                // Not interned: column names needn't outlive the query
+                fields[i] = naStr_fromdata(naNewString(c), (char*)s, strlen(s));
             }
         }
         row = naNewHash(c);
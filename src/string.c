@@ -26,11 +26,12 @@ char* naStr_data(naRef s)
 
 static void setlen(struct naStr* s, int sz)
 {
-    if(s->emblen == -1 && DATA(s)) naFree(s->data.ref.ptr);
+    if(sz > MAX_STR_EMBLEN) naGC_spend(0, sz+1);
+    if(s->emblen == -1 && DATA(s)) naArena_free(s->data.ref.ptr);
     if(sz > MAX_STR_EMBLEN) {
         s->emblen = -1;
         s->data.ref.len = sz;
-        s->data.ref.ptr = naAlloc(sz+1);
+        s->data.ref.ptr = naArena_alloc(sz+1);
     } else {
         s->emblen = sz;
     }
@@ -112,7 +113,7 @@ int naStr_numeric(naRef str)
 
 void naStr_gcclean(struct naStr* str)
 {
-    if(str->emblen == -1) naFree(str->data.ref.ptr);
+    if(str->emblen == -1) naArena_free(str->data.ref.ptr);
     str->data.ref.ptr = 0;
     str->data.ref.len = 0;
     str->emblen = -1;
@@ -1,6 +1,14 @@
 #ifndef _WIN32
 
 #include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 #include "code.h"
 
 void* naNewLock()
@@ -26,6 +34,86 @@ void naUnlock(void* lock)
     pthread_mutex_unlock((pthread_mutex_t*)lock);
 }
 
+// Fills in an absolute CLOCK_REALTIME time secs from now
+static void abstime(struct timespec* ts, double secs)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += (time_t)secs;
+    ts->tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+    if(ts->tv_nsec >= 1000000000) { ts->tv_sec++; ts->tv_nsec -= 1000000000; }
+}
+
+#ifdef __linux__
+
+// Semaphores are a count that waiters sleep on with futex(2), so
+// naSemUp() wakes only as many threads as it adds to the count, and
+// neither side takes a lock when no one is waiting.
+struct naSem {
+    volatile int count;
+    volatile int waiters;
+};
+
+static int futex(volatile int* addr, int op, int val, struct timespec* ts)
+{
+    return syscall(SYS_futex, addr, op, val, ts, 0, 0);
+}
+
+void* naNewSem()
+{
+    struct naSem* sem = naAlloc(sizeof(struct naSem));
+    sem->count = sem->waiters = 0;
+    return sem;
+}
+
+void naFreeSem(void* p)
+{
+    naFree(p);
+}
+
+// Waits for a nonzero count to take one from, until the deadline (a
+// naTime(), or negative for none).  Returns zero if it passes first.
+static int semwait(struct naSem* sem, double end)
+{
+    struct timespec ts;
+    while(1) {
+        int c = sem->count;
+        if(c > 0) {
+            if(__sync_bool_compare_and_swap(&sem->count, c, c-1)) return 1;
+            continue;
+        }
+        if(end >= 0) {
+            double left = end - naTime();
+            if(left <= 0) return 0;
+            ts.tv_sec = (time_t)left;
+            ts.tv_nsec = (long)((left - (time_t)left) * 1e9);
+        }
+        // The kernel only sleeps if the count is still zero, so an
+        // naSemUp() after the check above can't be missed
+        __sync_fetch_and_add(&sem->waiters, 1);
+        futex(&sem->count, FUTEX_WAIT_PRIVATE, 0, end >= 0 ? &ts : 0);
+        __sync_fetch_and_sub(&sem->waiters, 1);
+    }
+}
+
+void naSemDown(void* sh)
+{
+    semwait(sh, -1);
+}
+
+void naSemUp(void* sh, int count)
+{
+    struct naSem* sem = (struct naSem*)sh;
+    __sync_fetch_and_add(&sem->count, count);
+    if(sem->waiters) futex(&sem->count, FUTEX_WAKE_PRIVATE, count, 0);
+}
+
+int naSemDownTimed(void* sh, double secs)
+{
+    return semwait(sh, naTime() + secs);
+}
+
+#else
+
 struct naSem {
     pthread_mutex_t lock;
     pthread_cond_t cvar;
@@ -64,10 +152,118 @@ void naSemUp(void* sh, int count)
     struct naSem* sem = (struct naSem*)sh;
     pthread_mutex_lock(&sem->lock);
     sem->count += count;
-    pthread_cond_broadcast(&sem->cvar);
+    if(count == 1) pthread_cond_signal(&sem->cvar);
+    else pthread_cond_broadcast(&sem->cvar);
     pthread_mutex_unlock(&sem->lock);
 }
 
+int naSemDownTimed(void* sh, double secs)
+{
+    int ok;
+    struct timespec ts;
+    struct naSem* sem = (struct naSem*)sh;
+    abstime(&ts, secs);
+    pthread_mutex_lock(&sem->lock);
+    while(sem->count <= 0)
+        if(pthread_cond_timedwait(&sem->cvar, &sem->lock, &ts)) break;
+    if((ok = sem->count > 0)) sem->count--;
+    pthread_mutex_unlock(&sem->lock);
+    return ok;
+}
+
+#endif
+
+void* naNewRWLock()
+{
+    pthread_rwlock_t* lock = naAlloc(sizeof(pthread_rwlock_t));
+    pthread_rwlock_init(lock, 0);
+    return lock;
+}
+
+void naFreeRWLock(void* lock)
+{
+    pthread_rwlock_destroy(lock);
+    naFree(lock);
+}
+
+void naRWLock(void* lock, int write)
+{
+    if(write) pthread_rwlock_wrlock(lock);
+    else pthread_rwlock_rdlock(lock);
+}
+
+void naRWUnlock(void* lock, int write)
+{
+    pthread_rwlock_unlock(lock);
+}
+
+void* naNewCond()
+{
+    pthread_cond_t* cond = naAlloc(sizeof(pthread_cond_t));
+    pthread_cond_init(cond, 0);
+    return cond;
+}
+
+void naFreeCond(void* cond)
+{
+    pthread_cond_destroy(cond);
+    naFree(cond);
+}
+
+int naCondWait(void* cond, void* lock, double secs)
+{
+    struct timespec ts;
+    if(secs < 0) return !pthread_cond_wait(cond, lock);
+    abstime(&ts, secs);
+    return pthread_cond_timedwait(cond, lock, &ts) != ETIMEDOUT;
+}
+
+void naCondSignal(void* cond, int all)
+{
+    if(all) pthread_cond_broadcast(cond);
+    else pthread_cond_signal(cond);
+}
+
+void* naNewTls(void (*destroy)(void*))
+{
+    pthread_key_t* key = naAlloc(sizeof(pthread_key_t));
+    pthread_key_create(key, destroy);
+    return key;
+}
+
+void* naTlsGet(void* key) { return pthread_getspecific(*(pthread_key_t*)key); }
+void naTlsSet(void* key, void* val) { pthread_setspecific(*(pthread_key_t*)key, val); }
+
+int naAtomicCAS(volatile int* p, int old, int val)
+{
+    return __sync_bool_compare_and_swap(p, old, val);
+}
+
+void* naAtomicSwap(void** p, void* val)
+{
+    void* old;
+    do { old = *(void* volatile*)p; }
+    while(!__sync_bool_compare_and_swap(p, old, val));
+    return old;
+}
+
+int naAtomicCASRef(naRef* p, naRef old, naRef val)
+{
+    unsigned long long o, v;
+    memcpy(&o, &old, sizeof(o));
+    memcpy(&v, &val, sizeof(v));
+    return __sync_bool_compare_and_swap((volatile unsigned long long*)p, o, v);
+}
+
+void naMemBarrier() { __sync_synchronize(); }
+
+double naTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 #endif
 
 extern int GccWarningWorkaround_IsoCForbidsAnEmptySourceFile;
@@ -1,6 +1,7 @@
 #ifdef _WIN32
 
 #include <windows.h>
+#include <string.h>
 
 #define MAX_SEM_COUNT 1024 // What are the tradeoffs with this value?
 
@@ -18,6 +19,85 @@ void* naNewSem()           { return CreateSemaphore(0, 0, MAX_SEM_COUNT, 0); }
 void  naSemDown(void* sem) { WaitForSingleObject((HANDLE)sem, INFINITE); }
 void  naSemUp(void* sem, int count) { ReleaseSemaphore(sem, count, 0); }
 void naFreeSem(void* sem) { ReleaseSemaphore(sem, 1, 0); }
+int naSemDownTimed(void* sem, double secs)
+{
+    return WaitForSingleObject((HANDLE)sem, (DWORD)(secs*1000)) == WAIT_OBJECT_0;
+}
+
+void* naNewRWLock()
+{
+    PSRWLOCK lock = malloc(sizeof(SRWLOCK));
+    InitializeSRWLock(lock);
+    return lock;
+}
+
+void naFreeRWLock(void* lock) { free(lock); }
+
+void naRWLock(void* lock, int write)
+{
+    if(write) AcquireSRWLockExclusive(lock);
+    else AcquireSRWLockShared(lock);
+}
+
+void naRWUnlock(void* lock, int write)
+{
+    if(write) ReleaseSRWLockExclusive(lock);
+    else ReleaseSRWLockShared(lock);
+}
+
+void* naNewCond()
+{
+    PCONDITION_VARIABLE cond = malloc(sizeof(CONDITION_VARIABLE));
+    InitializeConditionVariable(cond);
+    return cond;
+}
+
+void naFreeCond(void* cond) { free(cond); }
+
+int naCondWait(void* cond, void* lock, double secs)
+{
+    return SleepConditionVariableCS(cond, lock,
+                                    secs < 0 ? INFINITE : (DWORD)(secs*1000));
+}
+
+void naCondSignal(void* cond, int all)
+{
+    if(all) WakeAllConditionVariable(cond);
+    else WakeConditionVariable(cond);
+}
+
+// No thread exit hook here: the records of exited threads leak
+void* naNewTls(void (*destroy)(void*)) { return (void*)(size_t)TlsAlloc(); }
+void* naTlsGet(void* key) { return TlsGetValue((DWORD)(size_t)key); }
+void naTlsSet(void* key, void* val) { TlsSetValue((DWORD)(size_t)key, val); }
+
+int naAtomicCAS(volatile int* p, int old, int val)
+{
+    return InterlockedCompareExchange((volatile LONG*)p, val, old) == old;
+}
+
+void* naAtomicSwap(void** p, void* val)
+{
+    return InterlockedExchangePointer(p, val);
+}
+
+int naAtomicCASRef(naRef* p, naRef old, naRef val)
+{
+    LONGLONG o, v;
+    memcpy(&o, &old, sizeof(o));
+    memcpy(&v, &val, sizeof(v));
+    return InterlockedCompareExchange64((volatile LONGLONG*)p, v, o) == o;
+}
+
+void naMemBarrier() { MemoryBarrier(); }
+
+double naTime()
+{
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return (double)t.QuadPart / f.QuadPart;
+}
 
 #endif
 
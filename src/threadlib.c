@@ -1,8 +1,13 @@
 #include <string.h>
 #ifdef _WIN32
 #include <windows.h>
+#define THREADFN(f) static DWORD WINAPI f(LPVOID param)
+typedef LPTHREAD_START_ROUTINE ThreadFn;
 #else
 #include <pthread.h>
+#include <unistd.h>
+#define THREADFN(f) static void* f(void* param)
+typedef void* (*ThreadFn)(void*);
 #endif
 
 #include "data.h"
@@ -19,11 +24,7 @@ typedef struct {
     naRef func;
 } ThreadData;
 
-#ifdef _WIN32
-static DWORD WINAPI threadtop(LPVOID param)
-#else
-static void* threadtop(void* param)
-#endif
+THREADFN(threadtop)
 {
     ThreadData* td = param;
     naCall(td->ctx, td->func, 0, 0, naNil(), naNil());
@@ -32,26 +33,360 @@ static void* threadtop(void* param)
     return 0;
 }
 
+// Starts a detached thread, returning an error message on failure
+static const char* spawn(ThreadFn fn, void* arg)
+{
+#ifdef _WIN32
+    HANDLE h = CreateThread(0, 0, fn, arg, 0, 0);
+    if(!h) return "CreateThread failed";
+    CloseHandle(h);
+#else
+    pthread_t t; int err;
+    if((err = pthread_create(&t, 0, fn, arg))) return strerror(err);
+    pthread_detach(t);
+#endif
+    return 0;
+}
+
 static naRef f_newthread(naContext c, naRef me, int argc, naRef* args)
 {
     ThreadData *td;
+    const char* err;
     if(argc < 1 || !naIsFunc(args[0]))
         naRuntimeError(c, "bad/missing argument to newthread");
     td = naAlloc(sizeof(*td));
     td->ctx = naNewContext();
     td->func = args[0];
     naTempSave(td->ctx, td->func);
+    if((err = spawn(threadtop, td)))
+        naRuntimeError(c, "newthread failed: %s", err);
+    return naNil();
+}
+
+////////////////////////////////////////////////////////////////////////
+// Thread pools: a fixed set of worker threads, each with its own
+// context and a deque of tasks.  Workers take their own newest task
+// first and, when out of work, steal the oldest task from another
+// worker.  A task submitted from inside a worker goes on that
+// worker's deque, others are spread around.  Joining a task that
+// hasn't finished runs other queued tasks in the meantime, so tasks
+// can fan out and join subtasks without tying up the pool.
+//
+// The function and arguments of a queued task, and then its result,
+// are kept alive with naGCSave().  Tasks and pools are reference
+// counted, as the handles can be collected while workers still use
+// them.
+
+struct Pool;
+
+struct Task {
+    volatile int refs;   // the handle, and the pool until it has run
+    volatile int done;
+    int failed;          // result is the error, not the return value
+    int key;             // naGCSave() key for job, then result
+    naRef job;           // vector of the function and its arguments
+    naRef result;
+    void* sem;           // up once the task is done
+    struct Pool* pool;
+};
+
+struct Worker {
+    struct Pool* pool;
+    void* lock;          // protects the deque
+    struct Task** tasks; // ring buffer, oldest at head
+    int head, n, sz;
+};
+
+struct Pool {
+    volatile int refs;   // the handle, each worker and each task
+    volatile int closing;
+    int nworkers;
+    volatile int next;   // round robin for tasks from outside
+    void* sem;           // one up per queued task
+    struct Worker* workers;
+    naIsolate isolate;   // tasks run there, so must come from there
+};
+
+static void* workerKey; // thread local struct Worker*
+
+// Returns the new count, which only the caller that took it to zero
+// can see as zero
+static int addref(volatile int* refs, int n)
+{
+    int old;
+    do { old = *refs; } while(!naAtomicCAS(refs, old, old + n));
+    return old + n;
+}
+
+static void poolrelease(struct Pool* p)
+{
+    int i;
+    if(addref(&p->refs, -1)) return;
+    for(i=0; i<p->nworkers; i++) {
+        naFreeLock(p->workers[i].lock);
+        naFree(p->workers[i].tasks);
+    }
+    naFree(p->workers);
+    naFreeSem(p->sem);
+    naFree(p);
+}
+
+static void taskrelease(struct Task* t)
+{
+    if(addref(&t->refs, -1)) return;
+    naGCRelease(t->key);
+    naFreeSem(t->sem);
+    poolrelease(t->pool);
+    naFree(t);
+}
+
+static void taskDestroy(void* t) { taskrelease(t); }
+static naGhostType TaskType = { taskDestroy, "task" };
+
+static void push(struct Worker* w, struct Task* t)
+{
+    naLock(w->lock);
+    if(w->n == w->sz) {
+        int i, sz = w->sz ? 2*w->sz : 16;
+        struct Task** ts = naAlloc(sz * sizeof(struct Task*));
+        for(i=0; i<w->n; i++)
+            ts[i] = w->tasks[(w->head + i) & (w->sz - 1)];
+        naFree(w->tasks);
+        w->tasks = ts;
+        w->head = 0;
+        w->sz = sz;
+    }
+    w->tasks[(w->head + w->n++) & (w->sz - 1)] = t;
+    naUnlock(w->lock);
+}
+
+// Takes the newest task from the worker's deque, or the oldest when
+// stealing
+static struct Task* take(struct Worker* w, int steal)
+{
+    struct Task* t = 0;
+    naLock(w->lock);
+    if(w->n) {
+        if(steal) {
+            t = w->tasks[w->head];
+            w->head = (w->head + 1) & (w->sz - 1);
+        } else {
+            t = w->tasks[(w->head + w->n - 1) & (w->sz - 1)];
+        }
+        w->n--;
+    }
+    naUnlock(w->lock);
+    return t;
+}
+
+// Finds a task to run, from the calling worker's own deque first
+static struct Task* findtask(struct Pool* p, struct Worker* self)
+{
+    int i, start;
+    struct Task* t;
+    if(self && (t = take(self, 0))) return t;
+    start = self ? self - p->workers : 0;
+    for(i=0; i<p->nworkers; i++) {
+        struct Worker* w = &p->workers[(start + i) % p->nworkers];
+        if(w != self && (t = take(w, 1))) return t;
+    }
+    return 0;
+}
+
+// Runs a task in ctx: a worker's own context, or a subcontext of one
+// joining another task.  Leaves the result (or the error) saved in
+// the task and wakes its joiners.
+static void runtask(naContext ctx, struct Task* t)
+{
+    char* err;
+    naRef result, *args = PTR(t->job).vec->rec->array;
+    int argc = PTR(t->job).vec->rec->size - 1;
+    ctx->dieArg = naNil(); // not reset by naCall() for C functions
+    ctx->error[0] = 0;
+    result = naCall(ctx, args[0], argc, args + 1, naNil(), naNil());
+    if(!ctx->callParent) naModLock();
+    naGCRelease(t->key);
+    if((err = naGetError(ctx))) {
+        t->failed = 1;
+        result = ctx->dieArg;
+        if(naIsNil(result))
+            result = naStr_fromdata(naNewString(ctx), err, strlen(err));
+    }
+    t->key = naGCSave(result);
+    t->result = result;
+    t->job = naNil();
+    if(ctx->callChild) naFreeContext(ctx->callChild); // left by an error
+    if(!ctx->callParent) naModUnlock();
+    naMemBarrier();
+    t->done = 1;
+    naSemUp(t->sem, 1);
+    taskrelease(t);
+}
+
+THREADFN(workertop)
+{
+    struct Worker* w = param;
+    struct Pool* p = w->pool;
+    naContext ctx;
+    naSetIsolate(p->isolate);
+    ctx = naNewContext();
+    ctx->unsafe = 1;
+    naTlsSet(workerKey, w);
+    while(1) {
+        struct Task* t;
+        naSemDown(p->sem);
+        if((t = findtask(p, w))) runtask(ctx, t);
+        else if(p->closing) break;
+    }
+    naFreeContext(ctx);
+    poolrelease(p);
+    return 0;
+}
+
+static void poolDestroy(void* pool)
+{
+    struct Pool* p = pool;
+    p->closing = 1;
+    naMemBarrier();
+    naSemUp(p->sem, p->nworkers);
+    poolrelease(p);
+}
+static naGhostType PoolType = { poolDestroy, "pool" };
+
+static int ncpus()
+{
 #ifdef _WIN32
-    CreateThread(0, 0, threadtop, td, 0, 0);
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
 #else
-    {
-        pthread_t t; int err;
-        if((err = pthread_create(&t, 0, threadtop, td)))
-            naRuntimeError(c, "newthread failed: %s", strerror(err));
-        pthread_detach(t);
-    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
 #endif
-    return naNil();
+}
+
+static struct Pool* newpool(naContext c, int n)
+{
+    int i;
+    struct Pool* p;
+    if(!workerKey) workerKey = naNewTls(0);
+    p = naAlloc(sizeof(*p));
+    naBZero(p, sizeof(*p));
+    p->nworkers = n;
+    p->sem = naNewSem();
+    p->workers = naAlloc(n * sizeof(struct Worker));
+    naBZero(p->workers, n * sizeof(struct Worker));
+    p->refs = 1;
+    p->isolate = naGetIsolate();
+    for(i=0; i<n; i++) {
+        const char* err;
+        p->workers[i].pool = p;
+        p->workers[i].lock = naNewLock();
+        addref(&p->refs, 1);
+        if((err = spawn(workertop, &p->workers[i]))) {
+            addref(&p->refs, -1);
+            p->nworkers = i;
+            poolDestroy(p);
+            naRuntimeError(c, "newpool failed: %s", err);
+        }
+    }
+    return p;
+}
+
+static naRef f_newpool(naContext c, naRef me, int argc, naRef* args)
+{
+    int n = ncpus();
+    if(argc > 0 && !naIsNil(args[0])) {
+        naRef nr = naNumValue(args[0]);
+        if(naIsNil(nr) || nr.num < 1)
+            naRuntimeError(c, "bad argument to newpool");
+        n = (int)nr.num;
+    }
+    return naNewGhost(c, &PoolType, newpool(c, n));
+}
+
+// Queues a job (a vector of a function and its arguments), returning
+// the task with one reference for the caller
+static struct Task* submit(struct Pool* p, naRef job)
+{
+    struct Task* t;
+    struct Worker* w;
+    t = naAlloc(sizeof(*t));
+    naBZero(t, sizeof(*t));
+    t->job = job;
+    t->key = naGCSave(t->job);
+    t->result = naNil();
+    t->sem = naNewSem();
+    t->pool = p;
+    t->refs = 2;
+    addref(&p->refs, 1);
+
+    w = naTlsGet(workerKey);
+    if(!w || w->pool != p) {
+        int n;
+        do { n = p->next; } while(!naAtomicCAS(&p->next, n, n + 1));
+        w = &p->workers[(unsigned int)n % p->nworkers];
+    }
+    push(w, t);
+    naSemUp(p->sem, 1);
+    return t;
+}
+
+static naRef f_submit(naContext c, naRef me, int argc, naRef* args)
+{
+    int i;
+    naRef job;
+    struct Pool* p = argc > 0 && naGhost_type(args[0]) == &PoolType
+        ? naGhost_ptr(args[0]) : 0;
+    if(!p || argc < 2 || !naIsFunc(args[1]))
+        naRuntimeError(c, "bad/missing argument to submit");
+    if(p->isolate != naGetIsolate())
+        naRuntimeError(c, "submit: pool belongs to another isolate");
+    job = naNewVector(c);
+    for(i=1; i<argc; i++)
+        naVec_append(job, args[i]);
+    return naNewGhost(c, &TaskType, submit(p, job));
+}
+
+// Waits for a task to finish, running others in the meantime
+static void waittask(naContext c, struct Task* t)
+{
+    while(!t->done) {
+        struct Worker* w = naTlsGet(workerKey);
+        struct Task* other = findtask(t->pool, w && w->pool == t->pool ? w : 0);
+        if(other) {
+            naContext subc = naSubContext(c);
+            runtask(subc, other);
+            naFreeContext(subc);
+            continue;
+        }
+        naEnterNative();
+        naSemDown(t->sem);
+        naSemUp(t->sem, 1); // for any other joiners
+        naLeaveNative();
+    }
+    naMemBarrier();
+}
+
+static naRef f_join(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Task* t = argc > 0 && naGhost_type(args[0]) == &TaskType
+        ? naGhost_ptr(args[0]) : 0;
+    if(!t) naRuntimeError(c, "bad/missing argument to join");
+    waittask(c, t);
+    if(t->failed) {
+        c->dieArg = t->result;
+        naRuntimeError(c, "__die__");
+    }
+    return t->result;
+}
+
+static naRef f_isdone(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Task* t = argc > 0 && naGhost_type(args[0]) == &TaskType
+        ? naGhost_ptr(args[0]) : 0;
+    if(!t) naRuntimeError(c, "bad/missing argument to isdone");
+    return naNum(t->done);
 }
 
 static naRef f_newlock(naContext c, naRef me, int argc, naRef* args)
@@ -62,9 +397,9 @@ static naRef f_newlock(naContext c, naRef me, int argc, naRef* args)
 static naRef f_lock(naContext c, naRef me, int argc, naRef* args)
 {
     if(argc > 0 && naGhost_type(args[0]) == &LockType) {
-        naModUnlock();
+        naEnterNative();
         naLock(naGhost_ptr(args[0]));
-        naModLock();
+        naLeaveNative();
     }
     return naNil();
 }
@@ -84,9 +419,9 @@ static naRef f_newsem(naContext c, naRef me, int argc, naRef* args)
 static naRef f_semdown(naContext c, naRef me, int argc, naRef* args)
 {
     if(argc > 0 && naGhost_type(args[0]) == &SemType) {
-        naModUnlock();
+        naEnterNative();
         naSemDown(naGhost_ptr(args[0]));
-        naModLock();
+        naLeaveNative();
     }
     return naNil();
 }
@@ -98,6 +433,728 @@ static naRef f_semup(naContext c, naRef me, int argc, naRef* args)
     return naNil();
 }
 
+////////////////////////////////////////////////////////////////////////
+// Reader-writer locks, condition variables and barriers.  As with
+// locks and semaphores, threads wait in native mode so they don't
+// hold up the collector.
+
+static void rwlockDestroy(void* lock) { naFreeRWLock(lock); }
+static naGhostType RWLockType = { rwlockDestroy, "rwlock" };
+
+static void condDestroy(void* cond) { naFreeCond(cond); }
+static naGhostType CondType = { condDestroy, "condition" };
+
+struct Barrier {
+    void* lock;
+    void* cond;
+    int n, count;
+    int gen; // bumped as each full set of threads is released
+};
+
+static void barrierDestroy(void* p)
+{
+    struct Barrier* b = p;
+    naFreeLock(b->lock);
+    naFreeCond(b->cond);
+    naFree(b);
+}
+static naGhostType BarrierType = { barrierDestroy, "barrier" };
+
+static naRef f_newrwlock(naContext c, naRef me, int argc, naRef* args)
+{
+    return naNewGhost(c, &RWLockType, naNewRWLock());
+}
+
+static naRef rwlock(naContext c, int argc, naRef* args, int write, int lock)
+{
+    if(argc > 0 && naGhost_type(args[0]) == &RWLockType) {
+        if(!lock) {
+            naRWUnlock(naGhost_ptr(args[0]), write);
+            return naNil();
+        }
+        naEnterNative();
+        naRWLock(naGhost_ptr(args[0]), write);
+        naLeaveNative();
+    }
+    return naNil();
+}
+
+static naRef f_rdlock(naContext c, naRef me, int argc, naRef* args)
+{
+    return rwlock(c, argc, args, 0, 1);
+}
+
+static naRef f_rdunlock(naContext c, naRef me, int argc, naRef* args)
+{
+    return rwlock(c, argc, args, 0, 0);
+}
+
+static naRef f_wrlock(naContext c, naRef me, int argc, naRef* args)
+{
+    return rwlock(c, argc, args, 1, 1);
+}
+
+static naRef f_wrunlock(naContext c, naRef me, int argc, naRef* args)
+{
+    return rwlock(c, argc, args, 1, 0);
+}
+
+static naRef f_newcond(naContext c, naRef me, int argc, naRef* args)
+{
+    return naNewGhost(c, &CondType, naNewCond());
+}
+
+static naRef f_wait(naContext c, naRef me, int argc, naRef* args)
+{
+    int ok;
+    double secs = -1;
+    if(argc < 2 || naGhost_type(args[0]) != &CondType
+       || naGhost_type(args[1]) != &LockType)
+        naRuntimeError(c, "bad/missing argument to wait");
+    if(argc > 2 && !naIsNil(args[2])) {
+        naRef t = naNumValue(args[2]);
+        if(naIsNil(t) || t.num < 0) naRuntimeError(c, "bad timeout");
+        secs = t.num;
+    }
+    naEnterNative();
+    ok = naCondWait(naGhost_ptr(args[0]), naGhost_ptr(args[1]), secs);
+    naLeaveNative();
+    return naNum(ok);
+}
+
+static naRef f_signal(naContext c, naRef me, int argc, naRef* args)
+{
+    if(argc > 0 && naGhost_type(args[0]) == &CondType)
+        naCondSignal(naGhost_ptr(args[0]), 0);
+    return naNil();
+}
+
+static naRef f_broadcast(naContext c, naRef me, int argc, naRef* args)
+{
+    if(argc > 0 && naGhost_type(args[0]) == &CondType)
+        naCondSignal(naGhost_ptr(args[0]), 1);
+    return naNil();
+}
+
+static naRef f_newbarrier(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Barrier* b;
+    naRef n = argc > 0 ? naNumValue(args[0]) : naNil();
+    if(naIsNil(n) || n.num < 1)
+        naRuntimeError(c, "bad/missing argument to newbarrier");
+    b = naAlloc(sizeof(*b));
+    b->lock = naNewLock();
+    b->cond = naNewCond();
+    b->n = (int)n.num;
+    b->count = b->gen = 0;
+    return naNewGhost(c, &BarrierType, b);
+}
+
+static naRef f_barrier(naContext c, naRef me, int argc, naRef* args)
+{
+    int gen, last = 0;
+    struct Barrier* b;
+    if(argc < 1 || naGhost_type(args[0]) != &BarrierType)
+        naRuntimeError(c, "bad/missing argument to barrier");
+    b = naGhost_ptr(args[0]);
+    naEnterNative();
+    naLock(b->lock);
+    gen = b->gen;
+    if(++b->count == b->n) {
+        b->count = 0;
+        b->gen++;
+        last = 1;
+        naCondSignal(b->cond, 1);
+    } else {
+        while(gen == b->gen)
+            naCondWait(b->cond, b->lock, -1);
+    }
+    naUnlock(b->lock);
+    naLeaveNative();
+    return naNum(last);
+}
+
+static naRef f_share(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef h = argc > 0 ? args[0] : naNewHash(c);
+    if(!naIsHash(h)) naRuntimeError(c, "bad argument to share");
+    naHash_share(h);
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Parallel map, filter and reduce: the vector is cut into chunks run
+// as pool tasks, each calling the function on its elements in a
+// subcontext.  Map and filter results are written straight into a
+// vector sized up front; each reduce chunk returns its own total,
+// and those are combined in order by the caller.
+
+#define PMAP 0
+#define PFILTER 1
+#define PREDUCE 2
+
+// Runs one chunk.  Args: mode, source, destination, function, start
+// index and end index.
+static naRef f_chunk(naContext c, naRef me, int argc, naRef* args)
+{
+    int i, mode = (int)args[0].num;
+    int start = (int)args[4].num, end = (int)args[5].num;
+    naRef r, a[2], acc = naNil();
+    naContext subc = naSubContext(c);
+    for(i=start; i<end; i++) {
+        a[0] = naVec_get(args[1], i);
+        if(mode == PREDUCE) {
+            if(i == start) { acc = a[0]; continue; }
+            a[1] = a[0];
+            a[0] = acc;
+            r = naCall(subc, args[3], 2, a, naNil(), naNil());
+        } else {
+            r = naCall(subc, args[3], 1, a, naNil(), naNil());
+        }
+        if(naGetError(subc)) naRethrowError(subc);
+        if(mode == PMAP) naVec_set(args[2], i, r);
+        else if(mode == PFILTER) naVec_set(args[2], i, naNum(naTrue(r)));
+        else acc = r;
+    }
+    naFreeContext(subc);
+    return acc;
+}
+
+static naRef parallel(naContext c, int argc, naRef* args, int mode,
+                      const char* name)
+{
+    int i, n, chunk, ntasks;
+    naRef vec, fn, dst, chunkfn, parts, result, err = naNil();
+    struct Task** tasks;
+    struct Pool* p = globals->threadPool; // made on demand, one per isolate
+    int argn = mode == PREDUCE ? 3 : 2; // the chunk size argument
+
+    vec = argc > 0 ? args[0] : naNil();
+    fn = argc > 1 ? args[1] : naNil();
+    if(!naIsVector(vec) || !naIsFunc(fn))
+        naRuntimeError(c, "bad/missing argument to %s", name);
+    if(argc > argn+1 && !naIsNil(args[argn+1])) {
+        if(naGhost_type(args[argn+1]) != &PoolType)
+            naRuntimeError(c, "%s: bad pool", name);
+        p = naGhost_ptr(args[argn+1]);
+        if(p->isolate != naGetIsolate())
+            naRuntimeError(c, "%s: pool belongs to another isolate", name);
+    } else if(!p) {
+        p = newpool(c, ncpus());
+        LOCK();
+        if(!globals->threadPool) { globals->threadPool = p; p = 0; }
+        UNLOCK();
+        if(p) poolDestroy(p);
+        p = globals->threadPool;
+    }
+    n = naVec_size(vec);
+    chunk = (n + 4*p->nworkers - 1) / (4*p->nworkers);
+    if(argc > argn && !naIsNil(args[argn])) {
+        naRef cr = naNumValue(args[argn]);
+        if(naIsNil(cr) || cr.num < 1)
+            naRuntimeError(c, "%s: bad chunk size", name);
+        chunk = (int)cr.num;
+    }
+    if(chunk < 1) chunk = 1;
+
+    dst = naNewVector(c);
+    if(mode != PREDUCE) naVec_setsize(dst, n);
+    chunkfn = naNewFunc(c, naNewCCode(c, f_chunk));
+    ntasks = (n + chunk - 1) / chunk;
+    tasks = naAlloc((ntasks ? ntasks : 1) * sizeof(struct Task*));
+    for(i=0; i<ntasks; i++) {
+        naRef job = naNewVector(c);
+        naVec_append(job, chunkfn);
+        naVec_append(job, naNum(mode));
+        naVec_append(job, vec);
+        naVec_append(job, dst);
+        naVec_append(job, fn);
+        naVec_append(job, naNum(i * chunk));
+        naVec_append(job, naNum(i == ntasks-1 ? n : (i+1) * chunk));
+        tasks[i] = submit(p, job);
+    }
+
+    // Wait for every chunk even after an error, so none is left
+    // running after this returns
+    parts = naNewVector(c);
+    for(i=0; i<ntasks; i++) {
+        waittask(c, tasks[i]);
+        if(tasks[i]->failed && naIsNil(err)) err = tasks[i]->result;
+        naVec_append(parts, tasks[i]->result);
+        taskrelease(tasks[i]);
+    }
+    naFree(tasks);
+    if(!naIsNil(err)) {
+        c->dieArg = err;
+        naRuntimeError(c, "__die__");
+    }
+
+    if(mode == PMAP) return dst;
+    if(mode == PFILTER) {
+        result = naNewVector(c);
+        for(i=0; i<n; i++)
+            if(naVec_get(dst, i).num)
+                naVec_append(result, naVec_get(vec, i));
+        return result;
+    }
+    result = argc > 2 ? args[2] : naNil();
+    for(i=0; i<ntasks; i++) {
+        naRef a[2];
+        naContext subc;
+        if(i == 0 && naIsNil(result)) { result = naVec_get(parts, 0); continue; }
+        a[0] = result;
+        a[1] = naVec_get(parts, i);
+        subc = naSubContext(c);
+        result = naCall(subc, fn, 2, a, naNil(), naNil());
+        if(naGetError(subc)) naRethrowError(subc);
+        naFreeContext(subc);
+    }
+    return result;
+}
+
+static naRef f_pmap(naContext c, naRef me, int argc, naRef* args)
+{
+    return parallel(c, argc, args, PMAP, "pmap");
+}
+
+static naRef f_pfilter(naContext c, naRef me, int argc, naRef* args)
+{
+    return parallel(c, argc, args, PFILTER, "pfilter");
+}
+
+static naRef f_preduce(naContext c, naRef me, int argc, naRef* args)
+{
+    return parallel(c, argc, args, PREDUCE, "preduce");
+}
+
+////////////////////////////////////////////////////////////////////////
+// Channels: queues of values passed between threads by reference.
+// The queue is only changed with the mod lock held (so the collector
+// can walk it through the ghost's refs hook), and threads wait for a
+// change with it released.  A waiting thread hangs a link on each
+// channel it waits on, and every change wakes all of them up to look
+// again.
+
+struct WaitLink {
+    void* sem;
+    struct WaitLink* next;
+};
+
+struct Chan {
+    void* lock;          // protects everything below
+    naRef* buf;          // ring buffer of queued values, oldest at head
+    int head, n, sz;
+    int cap;             // most values queued before send() waits, 0 for no limit
+    int closed;
+    struct WaitLink* waiters;
+};
+
+static void chanDestroy(void* p)
+{
+    struct Chan* ch = p;
+    naFreeLock(ch->lock);
+    naFree(ch->buf);
+    naFree(ch);
+}
+
+static void chanRefs(void* p, void (*fn)(naRef*))
+{
+    int i;
+    struct Chan* ch = p;
+    for(i=0; i<ch->n; i++)
+        fn(&ch->buf[(ch->head + i) & (ch->sz - 1)]);
+}
+
+static naGhostType ChanType = { chanDestroy, "channel", chanRefs };
+
+// Must be called with the channel lock held
+static void wakeall(struct Chan* ch)
+{
+    struct WaitLink* l;
+    for(l = ch->waiters; l; l = l->next)
+        naSemUp(l->sem, 1);
+}
+
+static int recvready(struct Chan* ch) { return ch->n || ch->closed; }
+static int sendready(struct Chan* ch)
+{
+    return !ch->cap || ch->n < ch->cap || ch->closed;
+}
+
+static int isready(struct Chan* ch, int (*ready)(struct Chan*))
+{
+    int r;
+    naLock(ch->lock);
+    r = ready(ch);
+    naUnlock(ch->lock);
+    return r;
+}
+
+// Waits until one of the channels passes the ready test, returning
+// its index, or -1 if the deadline (a naTime(), or negative for none)
+// passes first.  The channel may of course be changed again by
+// another thread before the caller gets to it.
+static int chanwait(struct Chan** chs, int n,
+                    int (*ready)(struct Chan*), double end)
+{
+    int i, j, r = -1, timedout = 0;
+    struct WaitLink* links;
+    void* sem;
+    for(i=0; i<n; i++)
+        if(isready(chs[i], ready)) return i;
+    if(end >= 0 && naTime() >= end) return -1;
+
+    sem = naNewSem();
+    links = naAlloc(n * sizeof(struct WaitLink));
+    while(r < 0 && !timedout) {
+        for(i=0; i<n && r < 0; i++) {
+            naLock(chs[i]->lock);
+            if(ready(chs[i])) {
+                r = i;
+            } else {
+                links[i].sem = sem;
+                links[i].next = chs[i]->waiters;
+                chs[i]->waiters = &links[i];
+            }
+            naUnlock(chs[i]->lock);
+        }
+        if(r < 0) {
+            double left = end - naTime();
+            naEnterNative();
+            if(end < 0) naSemDown(sem);
+            else if(left <= 0 || !naSemDownTimed(sem, left)) timedout = 1;
+            naLeaveNative();
+        }
+        for(j=0; j<i; j++) {
+            struct WaitLink** lp;
+            if(j == r) continue;
+            naLock(chs[j]->lock);
+            for(lp = &chs[j]->waiters; *lp != &links[j]; lp = &(*lp)->next);
+            *lp = links[j].next;
+            naUnlock(chs[j]->lock);
+        }
+    }
+    naFree(links);
+    naFreeSem(sem);
+    return r;
+}
+
+// Takes the oldest value off the channel, returning zero if empty
+static int chanpop(struct Chan* ch, naRef* out)
+{
+    int ok;
+    naLock(ch->lock);
+    if((ok = ch->n > 0)) {
+        *out = ch->buf[ch->head];
+        ch->buf[ch->head] = naNil();
+        ch->head = (ch->head + 1) & (ch->sz - 1);
+        ch->n--;
+        wakeall(ch);
+    }
+    naUnlock(ch->lock);
+    return ok;
+}
+
+// Queues a value, returning zero if the channel is full or closed
+static int chanpush(struct Chan* ch, naRef val)
+{
+    int ok;
+    naLock(ch->lock);
+    if((ok = !ch->closed && (!ch->cap || ch->n < ch->cap))) {
+        if(ch->n == ch->sz) {
+            int i, sz = ch->sz ? 2*ch->sz : 16;
+            naRef* buf = naAlloc(sz * sizeof(naRef));
+            for(i=0; i<ch->n; i++)
+                buf[i] = ch->buf[(ch->head + i) & (ch->sz - 1)];
+            naFree(ch->buf);
+            ch->buf = buf;
+            ch->head = 0;
+            ch->sz = sz;
+        }
+        ch->buf[(ch->head + ch->n++) & (ch->sz - 1)] = val;
+        wakeall(ch);
+    }
+    naUnlock(ch->lock);
+    return ok;
+}
+
+static struct Chan* chanarg(naContext c, int argc, naRef* args, const char* f)
+{
+    if(argc < 1 || naGhost_type(args[0]) != &ChanType)
+        naRuntimeError(c, "bad/missing argument to %s", f);
+    return naGhost_ptr(args[0]);
+}
+
+// The deadline for a timeout argument in seconds, or -1 for none
+static double deadline(naContext c, int argc, naRef* args, int i)
+{
+    naRef t;
+    if(argc <= i || naIsNil(args[i])) return -1;
+    t = naNumValue(args[i]);
+    if(naIsNil(t) || t.num < 0) naRuntimeError(c, "bad timeout");
+    return naTime() + t.num;
+}
+
+static naRef f_newchan(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Chan* ch;
+    naRef cap = argc > 0 && !naIsNil(args[0]) ? naNumValue(args[0]) : naNum(0);
+    if(naIsNil(cap) || cap.num < 0)
+        naRuntimeError(c, "bad argument to newchan");
+    ch = naAlloc(sizeof(*ch));
+    naBZero(ch, sizeof(*ch));
+    ch->lock = naNewLock();
+    ch->cap = (int)cap.num;
+    return naNewGhost(c, &ChanType, ch);
+}
+
+static naRef f_send(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Chan* ch = chanarg(c, argc, args, "send");
+    double end = deadline(c, argc, args, 2);
+    naRef val = argc > 1 ? args[1] : naNil();
+    while(!chanpush(ch, val)) {
+        if(ch->closed) naRuntimeError(c, "send on closed channel");
+        if(chanwait(&ch, 1, sendready, end) < 0) return naNum(0);
+    }
+    return naNum(1);
+}
+
+static naRef f_recv(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef val;
+    struct Chan* ch = chanarg(c, argc, args, "recv");
+    double end = deadline(c, argc, args, 1);
+    while(!chanpop(ch, &val)) {
+        if(ch->closed || chanwait(&ch, 1, recvready, end) < 0)
+            return naNil();
+    }
+    return val;
+}
+
+static naRef f_tryrecv(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef val, result;
+    struct Chan* ch = chanarg(c, argc, args, "tryrecv");
+    // Allocated first: a popped value is only on the C stack, where a
+    // collection wouldn't see it
+    result = naNewVector(c);
+    naVec_setsize(result, 1);
+    if(!chanpop(ch, &val)) return naNil();
+    naVec_set(result, 0, val);
+    return result;
+}
+
+static naRef f_close(naContext c, naRef me, int argc, naRef* args)
+{
+    struct Chan* ch = chanarg(c, argc, args, "close");
+    naLock(ch->lock);
+    ch->closed = 1;
+    wakeall(ch);
+    naUnlock(ch->lock);
+    return naNil();
+}
+
+static naRef f_select(naContext c, naRef me, int argc, naRef* args)
+{
+    int i, n = argc > 0 ? naVec_size(args[0]) : 0;
+    double end = deadline(c, argc, args, 1);
+    struct Chan** chs;
+    naRef val, result;
+    if(!n) naRuntimeError(c, "bad/missing argument to select");
+    result = naNewVector(c); // before popping, as in tryrecv()
+    naVec_setsize(result, 2);
+    chs = naAlloc(n * sizeof(struct Chan*));
+    for(i=0; i<n; i++) {
+        naRef ch = naVec_get(args[0], i);
+        if(naGhost_type(ch) != &ChanType) {
+            naFree(chs);
+            naRuntimeError(c, "select: not a channel");
+        }
+        chs[i] = naGhost_ptr(ch);
+    }
+    while((i = chanwait(chs, n, recvready, end)) >= 0) {
+        if(!chanpop(chs[i], &val)) {
+            if(!chs[i]->closed) continue;
+            val = naNil();
+        }
+        naVec_set(result, 0, naNum(i));
+        naVec_set(result, 1, val);
+        break;
+    }
+    naFree(chs);
+    return i < 0 ? naNil() : result;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Atomics: a single naRef slot changed with compare-and-swap, and a
+// bounded multi-producer, multi-consumer queue (Dmitry Vyukov's
+// design: each cell carries a sequence number saying whether it is
+// ready to be written or read at the current position).  Neither
+// blocks, so they are used without releasing the mod lock.  The
+// collector walks them with all such threads stopped, so it always
+// sees them between operations.
+
+static void atomicRefs(void* p, void (*fn)(naRef*)) { fn(p); }
+static naGhostType AtomicType = { naFree, "atomic", atomicRefs };
+
+struct QCell {
+    volatile int seq;
+    naRef val;
+};
+
+struct Queue {
+    unsigned int mask;  // size minus one, a power of two
+    volatile int head;  // next position to read
+    volatile int tail;  // next position to write
+    struct QCell* cells;
+};
+
+static void queueDestroy(void* p)
+{
+    naFree(((struct Queue*)p)->cells);
+    naFree(p);
+}
+
+static void queueRefs(void* p, void (*fn)(naRef*))
+{
+    unsigned int i;
+    struct Queue* q = p;
+    for(i=0; i<=q->mask; i++)
+        fn(&q->cells[i].val);
+}
+
+static naGhostType QueueType = { queueDestroy, "queue", queueRefs };
+
+static naRef* atomicarg(naContext c, int argc, naRef* args, const char* f)
+{
+    if(argc < 1 || naGhost_type(args[0]) != &AtomicType)
+        naRuntimeError(c, "bad/missing argument to %s", f);
+    return naGhost_ptr(args[0]);
+}
+
+static naRef f_newatomic(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef* slot = naAlloc(sizeof(naRef));
+    *slot = argc > 0 ? args[0] : naNum(0);
+    return naNewGhost(c, &AtomicType, slot);
+}
+
+static naRef f_atomicget(naContext c, naRef me, int argc, naRef* args)
+{
+    return *atomicarg(c, argc, args, "atomicget");
+}
+
+static naRef f_atomicswap(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef old, *slot = atomicarg(c, argc, args, "atomicswap");
+    naRef val = argc > 1 ? args[1] : naNil();
+    do { old = *slot; } while(!naAtomicCASRef(slot, old, val));
+    return old;
+}
+
+// Numbers compare by value, anything else by identity
+static int same(naRef a, naRef b)
+{
+    if(IS_NUM(a) && IS_NUM(b)) return a.num == b.num;
+    return IDENTICAL(a, b) || (IS_NIL(a) && IS_NIL(b));
+}
+
+static naRef f_atomiccas(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef cur, *slot = atomicarg(c, argc, args, "atomiccas");
+    naRef old = argc > 1 ? args[1] : naNil();
+    naRef val = argc > 2 ? args[2] : naNil();
+    do {
+        cur = *slot;
+        if(!same(cur, old)) return naNum(0);
+    } while(!naAtomicCASRef(slot, cur, val));
+    return naNum(1);
+}
+
+static naRef f_atomicadd(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef old, val, *slot = atomicarg(c, argc, args, "atomicadd");
+    naRef n = argc > 1 ? naNumValue(args[1]) : naNum(1);
+    if(naIsNil(n)) naRuntimeError(c, "atomicadd: bad increment");
+    do {
+        old = *slot;
+        if(!IS_NUM(old)) naRuntimeError(c, "atomicadd: not a number");
+        val = naNum(old.num + n.num);
+    } while(!naAtomicCASRef(slot, old, val));
+    return val;
+}
+
+static naRef f_newqueue(naContext c, naRef me, int argc, naRef* args)
+{
+    unsigned int i, sz = 1024;
+    struct Queue* q;
+    if(argc > 0 && !naIsNil(args[0])) {
+        naRef n = naNumValue(args[0]);
+        if(naIsNil(n) || n.num < 1 || n.num > (1<<30))
+            naRuntimeError(c, "bad argument to newqueue");
+        for(sz = 2; sz < n.num; sz <<= 1);
+    }
+    q = naAlloc(sizeof(struct Queue));
+    q->mask = sz - 1;
+    q->head = q->tail = 0;
+    q->cells = naAlloc(sz * sizeof(struct QCell));
+    for(i=0; i<sz; i++) {
+        q->cells[i].seq = i;
+        q->cells[i].val = naNil();
+    }
+    return naNewGhost(c, &QueueType, q);
+}
+
+static struct Queue* queuearg(naContext c, int argc, naRef* args, const char* f)
+{
+    if(argc < 1 || naGhost_type(args[0]) != &QueueType)
+        naRuntimeError(c, "bad/missing argument to %s", f);
+    return naGhost_ptr(args[0]);
+}
+
+static naRef f_qpush(naContext c, naRef me, int argc, naRef* args)
+{
+    struct QCell* cell;
+    struct Queue* q = queuearg(c, argc, args, "qpush");
+    unsigned int pos = q->tail;
+    if(argc < 2 || naIsNil(args[1]))
+        naRuntimeError(c, "qpush: cannot queue nil");
+    while(1) {
+        int dif;
+        cell = &q->cells[pos & q->mask];
+        dif = (int)((unsigned int)cell->seq - pos);
+        if(dif == 0 && naAtomicCAS(&q->tail, pos, pos + 1)) break;
+        if(dif < 0) return naNum(0); // full
+        pos = q->tail;
+    }
+    cell->val = args[1];
+    naMemBarrier();
+    cell->seq = pos + 1;
+    return naNum(1);
+}
+
+static naRef f_qpop(naContext c, naRef me, int argc, naRef* args)
+{
+    naRef val;
+    struct QCell* cell;
+    struct Queue* q = queuearg(c, argc, args, "qpop");
+    unsigned int pos = q->head;
+    while(1) {
+        int dif;
+        cell = &q->cells[pos & q->mask];
+        dif = (int)((unsigned int)cell->seq - (pos + 1));
+        if(dif == 0 && naAtomicCAS(&q->head, pos, pos + 1)) break;
+        if(dif < 0) return naNil(); // empty
+        pos = q->head;
+    }
+    val = cell->val;
+    cell->val = naNil();
+    naMemBarrier();
+    cell->seq = pos + q->mask + 1;
+    return val;
+}
+
 static naCFuncItem funcs[] = {
     { "newthread", f_newthread },
     { "newlock", f_newlock },
@@ -106,6 +1163,39 @@ static naCFuncItem funcs[] = {
     { "newsem", f_newsem },
     { "semdown", f_semdown },
     { "semup", f_semup },
+    { "newrwlock", f_newrwlock },
+    { "rdlock", f_rdlock },
+    { "rdunlock", f_rdunlock },
+    { "wrlock", f_wrlock },
+    { "wrunlock", f_wrunlock },
+    { "newcond", f_newcond },
+    { "wait", f_wait },
+    { "signal", f_signal },
+    { "broadcast", f_broadcast },
+    { "newbarrier", f_newbarrier },
+    { "barrier", f_barrier },
+    { "share", f_share },
+    { "newpool", f_newpool },
+    { "submit", f_submit },
+    { "join", f_join },
+    { "isdone", f_isdone },
+    { "pmap", f_pmap },
+    { "pfilter", f_pfilter },
+    { "preduce", f_preduce },
+    { "newatomic", f_newatomic },
+    { "atomicget", f_atomicget },
+    { "atomicswap", f_atomicswap },
+    { "atomiccas", f_atomiccas },
+    { "atomicadd", f_atomicadd },
+    { "newqueue", f_newqueue },
+    { "qpush", f_qpush },
+    { "qpop", f_qpop },
+    { "newchan", f_newchan },
+    { "send", f_send },
+    { "recv", f_recv },
+    { "tryrecv", f_tryrecv },
+    { "close", f_close },
+    { "select", f_select },
     { 0 }
 };
 
@@ -48,7 +48,9 @@ static naRef f_waitpid(naContext ctx, naRef me, int argc, naRef* args)
     naRef opts = argc > 1 ? naNumValue(args[1]) : naNum(0);
     if(!IS_NUM(pid) || !IS_NUM(opts))
         naRuntimeError(ctx, "bad argument to waitpid");
+    naEnterNative();
     child = waitpid((pid_t)pid.num, &status, opts.num == 0 ? 0 : WNOHANG);
+    naLeaveNative();
     if(child < 0) naRuntimeError(ctx, strerror(errno));
     result = naNewVector(ctx);
     naVec_append(result, naNum(child));
@@ -163,9 +165,9 @@ static naRef f_environ(naContext ctx, naRef me, int argc, naRef* args)
 static naRef f_sleep(naContext ctx, naRef me, int argc, naRef* args)
 {
     double secs = argc > 0 ? naNumValue(args[0]).num : 0;
-    naModUnlock();
+    naEnterNative();
     usleep((useconds_t)(secs * 1e6));
-    naModLock();
+    naLeaveNative();
     return naNil();
 }
 
@@ -4,7 +4,9 @@
 static struct VecRec* newvecrec(struct VecRec* old)
 {
     int i, oldsz = old ? old->size : 0, newsz = 1 + ((oldsz*3)>>1);
-    struct VecRec* vr = naAlloc(sizeof(struct VecRec) + sizeof(naRef) * newsz);
+    struct VecRec* vr;
+    naGC_spend(0, sizeof(struct VecRec) + sizeof(naRef) * newsz);
+    vr = naArena_alloc(sizeof(struct VecRec) + sizeof(naRef) * newsz);
     if(oldsz > newsz) oldsz = newsz; // race protection
     vr->alloced = newsz;
     vr->size = oldsz;
@@ -21,7 +23,7 @@ static void resize(struct naVec* v)
 
 void naVec_gcclean(struct naVec* v)
 {
-    naFree(v->rec);
+    naArena_free(v->rec);
     v->rec = 0;
 }
 
@@ -72,8 +74,10 @@ int naVec_append(naRef vec, naRef o)
 void naVec_setsize(naRef vec, int sz)
 {
     int i;
-    struct VecRec* v = PTR(vec).vec->rec;
-    struct VecRec* nv = naAlloc(sizeof(struct VecRec) + sizeof(naRef) * sz);
+    struct VecRec *v, *nv;
+    naGC_spend(0, sizeof(struct VecRec) + sizeof(naRef) * sz);
+    v = PTR(vec).vec->rec;
+    nv = naArena_alloc(sizeof(struct VecRec) + sizeof(naRef) * sz);
     nv->size = sz;
     nv->alloced = sz;
     for(i=0; i<sz; i++)